@@ -0,0 +1,597 @@
+/*
+HOW TO RUN?
+	g++ -O2 -std=c++17 -pthread bench_malloc_4.cpp -o bench_malloc_4
+	./bench_malloc_4            (runs every benchmark)
+	./bench_malloc_4 <name>     (runs only the benchmarks whose name contains <name>)
+	(build with -DSMALLOC_DEBUG as well to see what the debug checks cost)
+
+NOTE: every benchmark runs in a child process, so each one starts with a clean heap.
+ */
+
+#include "malloc_4.cpp"
+#include "smalloc_allocator.h"
+#include "smalloc_fixed.h"
+#include <unistd.h>
+#include <assert.h>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <map>
+#include <list>
+#include <sys/wait.h>
+
+/*******************************************************************************
+ *  AUXILIARY FUNCTIONS
+ ******************************************************************************/
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsed_ms(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+/* Small deterministic generator, so every run sees the same sizes. */
+size_t next_random(size_t &state) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return state >> 33;
+}
+
+/*******************************************************************************
+ *  BENCHMARKS
+ ******************************************************************************/
+
+/* Tens of thousands of medium free blocks (1KB-8KB), kept apart by small
+ * allocated blocks so they can't merge. Then best-fit smalloc/sfree churn. */
+void bench_medium_free_blocks() {
+    const int BLOCKS = 40000, ROUNDS = 50000;
+    static void* medium[BLOCKS];
+    static void* pinned[BLOCKS];
+    size_t state = 42;
+
+    for (int i = 0; i < BLOCKS; i++) {
+        medium[i] = smalloc(KB + next_random(state) % (7 * KB));
+        pinned[i] = smalloc(16);
+        assert(medium[i] && pinned[i]);
+    }
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < BLOCKS; i++) {
+        sfree(medium[i]);
+    }
+    double free_ms = elapsed_ms(start);
+
+    start = Clock::now();
+    for (int i = 0; i < ROUNDS; i++) {
+        void* p = smalloc(KB + next_random(state) % (7 * KB));
+        assert(p);
+        sfree(p);
+    }
+    double churn_ms = elapsed_ms(start);
+
+    printf("  %d frees into the histogram: %.1f ms\n", BLOCKS, free_ms);
+    printf("  %d smalloc/sfree over %zu free blocks: %.1f ms\n",
+           ROUNDS, _num_free_blocks(), churn_ms);
+}
+
+/* Repeated 200KB buffers, just above the default mmap threshold. A fixed
+ * threshold maps and unmaps every one of them, the sliding one moves past them. */
+void bench_large_buffers() {
+    const int ROUNDS = 20000;
+    const size_t SIZE = 200 * KB;
+
+    for (int fixed = 1; fixed >= 0; fixed--) {
+        smallopt(SMALLOPT_MMAP_THRESHOLD, fixed ? LARGE_ALLOC : 0);
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < ROUNDS; i++) {
+            char* p = (char*)smalloc(SIZE);
+            assert(p);
+            p[0] = p[SIZE - 1] = 1;
+            sfree(p);
+        }
+        printf("  %d smalloc/sfree of 200KB, %s threshold (%zu): %.1f ms\n", ROUNDS,
+               fixed ? "fixed" : "sliding", _mmap_threshold(), elapsed_ms(start));
+    }
+}
+
+/* Small blocks (16-512 bytes) replaced at random in a working set, the common case
+ * that the debug build's checks must not slow down too much. */
+void bench_small_churn() {
+    const int LIVE = 4096, ROUNDS = 1000000;
+    static void* live[LIVE];
+    size_t state = 7;
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < ROUNDS; i++) {
+        int slot = next_random(state) % LIVE;
+        sfree(live[slot]);
+        live[slot] = smalloc(16 + next_random(state) % 497);
+        assert(live[slot]);
+    }
+    printf("  %d smalloc/sfree over %d live blocks: %.1f ms\n", ROUNDS, LIVE, elapsed_ms(start));
+}
+
+/* Inserts KEYS random keys, then erases them in the same order. */
+template <class Map>
+double map_insert_erase(Map& map) {
+    const int KEYS = 200000;
+    size_t state = 3;
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < KEYS; i++) {
+        map[(int)next_random(state)] = i;
+    }
+    state = 3;
+    for (int i = 0; i < KEYS; i++) {
+        map.erase((int)next_random(state));
+    }
+    assert(map.empty());
+    return elapsed_ms(start);
+}
+
+/* Keeps a queue of LENGTH elements and pushes/pops ROUNDS elements through it. */
+template <class List>
+double list_push_pop(List& list) {
+    const int LENGTH = 10000, ROUNDS = 2000000;
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < LENGTH; i++) {
+        list.push_back(i);
+    }
+    for (int i = 0; i < ROUNDS; i++) {
+        list.push_back(i);
+        list.pop_front();
+    }
+    list.clear();
+    return elapsed_ms(start);
+}
+
+/* The same map work with the default allocator, SmallocAllocator, and a node pool. */
+void bench_map_allocators() {
+    std::map<int, int> with_default;
+    printf("  std::allocator:      %.1f ms\n", map_insert_erase(with_default));
+
+    std::map<int, int, std::less<int>, SmallocAllocator<std::pair<const int, int>>> with_smalloc;
+    printf("  SmallocAllocator:    %.1f ms\n", map_insert_erase(with_smalloc));
+
+    SmallocPoolResource pool(64);
+    std::pmr::map<int, int> with_pool(&pool);
+    printf("  SmallocPoolResource: %.1f ms\n", map_insert_erase(with_pool));
+}
+
+void bench_list_allocators() {
+    std::list<int> with_default;
+    printf("  std::allocator:      %.1f ms\n", list_push_pop(with_default));
+
+    std::list<int, SmallocAllocator<int>> with_smalloc;
+    printf("  SmallocAllocator:    %.1f ms\n", list_push_pop(with_smalloc));
+
+    SmallocPoolResource pool(64);
+    std::pmr::list<int> with_pool(&pool);
+    printf("  SmallocPoolResource: %.1f ms\n", list_push_pop(with_pool));
+}
+
+/* 64 byte blocks replaced at random in a working set, with smalloc and with smalloc_fixed. */
+void bench_fixed_sizes() {
+    const int LIVE = 1024, ROUNDS = 2000000;
+    static void* live[LIVE];
+    size_t state = 11;
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < ROUNDS; i++) {
+        int slot = next_random(state) % LIVE;
+        sfree(live[slot]);
+        live[slot] = smalloc(64);
+    }
+    printf("  smalloc(64):          %.1f ms\n", elapsed_ms(start));
+    for (int i = 0; i < LIVE; i++) {
+        sfree(live[i]);
+        live[i] = nullptr;
+    }
+
+    start = Clock::now();
+    for (int i = 0; i < ROUNDS; i++) {
+        int slot = next_random(state) % LIVE;
+        sfree_fixed<64>(live[slot]);
+        live[slot] = smalloc_fixed<64>();
+    }
+    printf("  smalloc_fixed<64>():  %.1f ms\n", elapsed_ms(start));
+}
+
+/* copyBlock/zeroBlock against the memmove/memset calls they replaced, 1KB to 100MB.
+ * Each size moves about 2GB in total, over the same (already touched) buffers. */
+void bench_copy_zero() {
+    const size_t SIZES[] = {KB, 64 * KB, 1024 * KB, 16 * 1024 * KB, MAX_SIZE};
+    const size_t TOTAL = (size_t)2 * 1024 * 1024 * KB;
+    char* src = (char*)smalloc(MAX_SIZE);
+    char* dst = (char*)smalloc(MAX_SIZE);
+    assert(src && dst);
+    memset(src, 1, MAX_SIZE);
+    memset(dst, 2, MAX_SIZE);
+
+    for (size_t size : SIZES) {
+        size_t rounds = TOTAL / size;
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < rounds; i++) memmove(dst, src, size);
+        double move_ms = elapsed_ms(start);
+        start = Clock::now();
+        for (size_t i = 0; i < rounds; i++) copyBlock(dst, src, size);
+        double copy_ms = elapsed_ms(start);
+        start = Clock::now();
+        for (size_t i = 0; i < rounds; i++) memset(dst, 0, size);
+        double memset_ms = elapsed_ms(start);
+        start = Clock::now();
+        for (size_t i = 0; i < rounds; i++) zeroBlock(dst, size);
+        double zero_ms = elapsed_ms(start);
+        printf("  %6zu KB: memmove %7.1f ms, copyBlock %7.1f ms, memset %7.1f ms, zeroBlock %7.1f ms\n",
+               size / KB, move_ms, copy_ms, memset_ms, zero_ms);
+    }
+    printf("  stream threshold %zu KB\n", stream_threshold / KB);
+    sfree(src);
+    sfree(dst);
+}
+
+/* Buffers that grow a few hundred bytes at a time while other blocks are allocated
+ * after them, with srealloc and with glibc's realloc. */
+template <class Realloc>
+double grow_buffers(int buffers, size_t step, size_t final_size, Realloc grow) {
+    static char* buffer[64];
+    static void* pinned[64];
+    size_t state = 5;
+
+    Clock::time_point start = Clock::now();
+    for (size_t size = step; size <= final_size; size += step) {
+        for (int i = 0; i < buffers; i++) {
+            buffer[i] = (char*)grow(buffer[i], size);
+            assert(buffer[i]);
+            buffer[i][size - 1] = 1;
+            // a short lived block right after the buffer, like the log line being formatted
+            grow(pinned[i], 0);
+            pinned[i] = grow(nullptr, 16 + next_random(state) % 240);
+        }
+    }
+    double ms = elapsed_ms(start);
+    for (int i = 0; i < buffers; i++) {
+        grow(buffer[i], 0);
+        grow(pinned[i], 0);
+        buffer[i] = nullptr;
+        pinned[i] = nullptr;
+    }
+    return ms;
+}
+
+void bench_growing_buffers() {
+    struct Pattern {
+        const char* name;
+        int buffers;
+        size_t step;
+        size_t final_size;
+    };
+    const Pattern PATTERNS[] = {
+        {"1 buffer, +300B to 4MB ", 1, 300, 4 * 1024 * KB},
+        {"16 buffers, +200B to 256KB", 16, 200, 256 * KB},
+        {"64 buffers, +64B to 32KB", 64, 64, 32 * KB},
+    };
+
+    for (const Pattern& pattern : PATTERNS) {
+        size_t copied = _num_realloc_copied_bytes();
+        double smalloc_ms = grow_buffers(pattern.buffers, pattern.step, pattern.final_size,
+                                         [](void* p, size_t size) -> void* {
+            if (size == 0) { sfree(p); return nullptr; }
+            return srealloc(p, size);
+        });
+        copied = _num_realloc_copied_bytes() - copied;
+        double glibc_ms = grow_buffers(pattern.buffers, pattern.step, pattern.final_size,
+                                       [](void* p, size_t size) -> void* {
+            if (size == 0) { free(p); return nullptr; }
+            return realloc(p, size);
+        });
+        printf("  %-27s srealloc %7.1f ms, %9zu KB copied | realloc %7.1f ms\n",
+               pattern.name, smalloc_ms, copied / KB, glibc_ms);
+    }
+}
+
+/* Resident set size in KB, from /proc/self/statm. */
+size_t resident_kb() {
+    size_t size = 0, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%zu %zu", &size, &resident) != 2) resident = 0;
+        fclose(statm);
+    }
+    return resident * getpagesize() / KB;
+}
+
+/* A cache of 64 buffers of 1MB, all shrunk to 64KB: once as mappings, once as heap blocks. */
+void bench_shrink_buffers() {
+    const int BUFFERS = 64;
+    const size_t SIZE = 1024 * KB, SHRUNK = 64 * KB;
+    static char* buffer[BUFFERS];
+    static void* pinned[BUFFERS];
+
+    for (int heap = 0; heap <= 1; heap++) {
+        smallopt(SMALLOPT_MMAP_THRESHOLD, heap ? 2 * SIZE : LARGE_ALLOC);
+        for (int i = 0; i < BUFFERS; i++) {
+            buffer[i] = (char*)smalloc(SIZE);
+            pinned[i] = smalloc(16);
+            assert(buffer[i] && pinned[i]);
+            memset(buffer[i], 1, SIZE);
+        }
+        size_t before = resident_kb();
+
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < BUFFERS; i++) {
+            char* p = (char*)srealloc(buffer[i], SHRUNK);
+            assert(p == buffer[i]);
+        }
+        double ms = elapsed_ms(start);
+        printf("  %d %s blocks 1MB -> 64KB: %.2f ms, RSS %zu KB -> %zu KB\n", BUFFERS,
+               heap ? "heap" : "mmap", ms, before, resident_kb());
+
+        for (int i = 0; i < BUFFERS; i++) {
+            sfree(buffer[i]);
+            sfree(pinned[i]);
+        }
+    }
+}
+
+/* Replaces blocks at random in a working set, either with a block of the same size
+ * (the common free-then-reallocate churn) or with a random size. */
+double churn(bool same_size) {
+    const int LIVE = 4096, ROUNDS = 1000000;
+    static void* live[LIVE];
+    static size_t sizes[LIVE];
+    size_t state = 13;
+
+    for (int i = 0; i < LIVE; i++) {
+        sizes[i] = 16 + next_random(state) % 8 * 64;
+        live[i] = smalloc(sizes[i]);
+    }
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < ROUNDS; i++) {
+        int slot = next_random(state) % LIVE;
+        sfree(live[slot]);
+        if (!same_size) sizes[slot] = 16 + next_random(state) % 497;
+        live[slot] = smalloc(sizes[slot]);
+        assert(live[slot]);
+    }
+    double ms = elapsed_ms(start);
+    for (int i = 0; i < LIVE; i++) {
+        sfree(live[i]);
+    }
+    return ms;
+}
+
+void bench_deferred_coalescing() {
+    for (int deferred = 0; deferred <= 1; deferred++) {
+        smallopt(SMALLOPT_DEFERRED_COALESCING, deferred);
+        double same_ms = churn(true);
+        double mixed_ms = churn(false);
+        printf("  %-8s same size churn %6.1f ms, mixed size churn %6.1f ms\n",
+               deferred ? "deferred" : "eager", same_ms, mixed_ms);
+    }
+}
+
+/* A cache's index: a hash table of ENTRIES nodes with their keys and names. */
+struct CacheEntry {
+    CacheEntry* next;
+    size_t key;
+    char name[40];
+};
+
+struct CacheTable {
+    CacheEntry** buckets;
+    size_t count;
+};
+
+const size_t CACHE_ENTRIES = 1000000, CACHE_BUCKETS = 1 << 20;
+
+CacheTable* build_cache() {
+    CacheTable* table = (CacheTable*)smalloc(sizeof(CacheTable));
+    table->buckets = (CacheEntry**)scalloc(CACHE_BUCKETS, sizeof(CacheEntry*));
+    table->count = 0;
+    size_t state = 17;
+    for (size_t i = 0; i < CACHE_ENTRIES; i++) {
+        CacheEntry* entry = (CacheEntry*)smalloc(sizeof(CacheEntry));
+        assert(entry);
+        entry->key = next_random(state);
+        snprintf(entry->name, sizeof(entry->name), "entry-%zu", entry->key);
+        CacheEntry** bucket = &table->buckets[entry->key % CACHE_BUCKETS];
+        entry->next = *bucket;
+        *bucket = entry;
+        table->count++;
+    }
+    return table;
+}
+
+size_t walk_cache(CacheTable* table) {
+    size_t names = 0;
+    for (size_t i = 0; i < CACHE_BUCKETS; i++) {
+        for (CacheEntry* entry = table->buckets[i]; entry != nullptr; entry = entry->next) {
+            names += entry->name[0] == 'e';
+        }
+    }
+    return names;
+}
+
+/* Restarting with a 1M entry cache: rebuilding it on the sbrk heap, against reopening
+ * a persistent heap that a previous process built and closed. */
+void bench_persistent_restart() {
+    char path[] = "/tmp/smalloc_bench_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    // The previous run, in its own process
+    if (!fork()) {
+        assert(spersist_open(path, 256 * 1024 * KB) == 0);
+        Clock::time_point start = Clock::now();
+        spersist_set_root(build_cache());
+        double build_ms = elapsed_ms(start);
+        start = Clock::now();
+        assert(spersist_close() == 0);
+        printf("  first run, build in the file heap: %7.1f ms, close: %6.1f ms\n",
+               build_ms, elapsed_ms(start));
+        exit(0);
+    }
+    wait(nullptr);
+
+    if (!fork()) {
+        Clock::time_point start = Clock::now();
+        CacheTable* table = build_cache();
+        assert(walk_cache(table) == CACHE_ENTRIES);
+        printf("  restart without it, rebuild:       %7.1f ms\n", elapsed_ms(start));
+        exit(0);
+    }
+    wait(nullptr);
+
+    Clock::time_point start = Clock::now();
+    assert(spersist_open(path, 0) == 1);
+    CacheTable* table = (CacheTable*)spersist_get_root();
+    double open_ms = elapsed_ms(start);
+    start = Clock::now();
+    assert(table->count == CACHE_ENTRIES && walk_cache(table) == CACHE_ENTRIES);
+    printf("  restart with it, reopen: %.2f ms, first full walk: %.1f ms\n",
+           open_ms, elapsed_ms(start));
+    spersist_close();
+    unlink(path);
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+struct Benchmark {
+    const char* name;
+    void (*func)();
+};
+
+/* A server's bursts: 64 buffers of 1MB between pinned blocks, freed again, then 20ms of
+ * idle time. Time spent in the requests, the RSS at the end of the idle time, and the
+ * RSS after a second of idle time once the bursts are over. */
+void bench_maintenance_thread() {
+    const int BUFFERS = 64, BURSTS = 20;
+    const size_t SIZE = 1024 * KB;
+    static char* buffer[BUFFERS];
+    static void* pinned[BUFFERS];
+    smallopt(SMALLOPT_MMAP_THRESHOLD, 2 * SIZE);
+
+    for (int background = 0; background <= 1; background++) {
+        if (background) smalloc_maintenance_start(5);
+        double ms = 0;
+        size_t idle_kb = 0;
+        for (int burst = 0; burst < BURSTS; burst++) {
+            Clock::time_point start = Clock::now();
+            for (int i = 0; i < BUFFERS; i++) {
+                buffer[i] = (char*)smalloc(SIZE);
+                pinned[i] = smalloc(16);
+                assert(buffer[i] && pinned[i]);
+                memset(buffer[i], 1, SIZE);
+            }
+            for (int i = 0; i < BUFFERS; i++) {
+                sfree(buffer[i]);
+                sfree(pinned[i]);
+            }
+            ms += elapsed_ms(start);
+            usleep(20000);
+            idle_kb += resident_kb();
+        }
+        usleep(1000 * 1000);
+        size_t after_kb = resident_kb();
+        if (background) smalloc_maintenance_stop();
+        printf("  %-10s %.1f ms in requests, idle RSS %zu KB, %zu KB after a second\n",
+               background ? "background" : "none", ms, idle_kb / BURSTS, after_kb);
+    }
+}
+
+/* One of many threads: replaces 64 byte blocks in a small working set, then stays
+ * alive (and keeps its cache) until every thread is done. */
+pthread_barrier_t threads_done;
+
+void* fixed_churn_worker(void* arg) {
+    const int LIVE = 16, ROUNDS = 20000;
+    void* live[LIVE] = {};
+    size_t state = (size_t)arg;
+    for (int i = 0; i < ROUNDS; i++) {
+        int slot = next_random(state) % LIVE;
+        sfree_fixed<64>(live[slot]);
+        live[slot] = smalloc_fixed<64>();
+        assert(live[slot]);
+    }
+    for (int i = 0; i < LIVE; i++) {
+        sfree_fixed<64>(live[i]);
+    }
+    pthread_barrier_wait(&threads_done);
+    pthread_barrier_wait(&threads_done);
+    return nullptr;
+}
+
+/* 1000 threads, far more than the cores, with a cache per thread and with a cache per CPU:
+ * the time they take, and the blocks the caches hold while the threads are idle. */
+void bench_many_threads() {
+    const int THREADS = 1000;
+    static pthread_t threads[THREADS];
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * KB);
+
+    for (int per_cpu = 0; per_cpu <= 1; per_cpu++) {
+#ifdef FIXED_RSEQ
+        fixed_per_cpu = per_cpu;
+#else
+        if (per_cpu) break;
+#endif
+        pthread_barrier_init(&threads_done, nullptr, THREADS + 1);
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < THREADS; i++) {
+            assert(pthread_create(&threads[i], &attr, fixed_churn_worker, (void*)(size_t)(i + 1)) == 0);
+        }
+        pthread_barrier_wait(&threads_done);
+        double ms = elapsed_ms(start);
+        size_t cached = _num_allocated_blocks() - _num_free_blocks();
+        pthread_barrier_wait(&threads_done);
+        for (int i = 0; i < THREADS; i++) {
+            pthread_join(threads[i], nullptr);
+        }
+        pthread_barrier_destroy(&threads_done);
+        printf("  %-10s %.1f ms, %zu blocks cached by idle threads\n",
+               per_cpu ? "per CPU" : "per thread", ms, cached);
+    }
+}
+
+static const Benchmark BENCHMARKS[] = {
+    {"medium_free_blocks", bench_medium_free_blocks},
+    {"large_buffers", bench_large_buffers},
+    {"small_churn", bench_small_churn},
+    {"map_allocators", bench_map_allocators},
+    {"list_allocators", bench_list_allocators},
+    {"fixed_sizes", bench_fixed_sizes},
+    {"many_threads", bench_many_threads},
+    {"copy_zero", bench_copy_zero},
+    {"growing_buffers", bench_growing_buffers},
+    {"shrink_buffers", bench_shrink_buffers},
+    {"deferred_coalescing", bench_deferred_coalescing},
+    {"persistent_restart", bench_persistent_restart},
+    {"maintenance_thread", bench_maintenance_thread},
+};
+
+static void callBenchFunction(const Benchmark &bench) {
+    std::cout << bench.name << std::endl;
+    if (!fork()) {  // bench as son, to get a clear heap
+        bench.func();
+        exit(0);
+    } else {		// father waits for son before continuing to next bench
+        int exit_status = 0;
+        wait(&exit_status);
+        if (exit_status)
+            std::cout << "*** FAILED with exit status " << exit_status << std::endl;
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    for (const Benchmark &bench : BENCHMARKS) {
+        if (argc < 2 || strstr(bench.name, argv[1]))
+            callBenchFunction(bench);
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+HOW TO RUN?
+	g++ -O2 -std=c++17 -pthread bench_malloc_core.cpp -o bench_malloc_core
+	./bench_malloc_core            (runs every benchmark)
+	./bench_malloc_core <name>     (runs only the benchmarks whose name contains <name>)
+
+NOTE: every benchmark runs in a child process. The policy combinations it compares run one
+      after the other in that process, each with a heap of its own.
+ */
+
+#include "malloc_core.h"
+#include <unistd.h>
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <sys/wait.h>
+#include <iostream>
+
+#define KB 1024
+
+/*******************************************************************************
+ *  AUXILIARY FUNCTIONS
+ ******************************************************************************/
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsed_ms(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+typedef SmallocCore<FirstFit, SplitAbove<128>, MergeNeighbours, Align<8>, NoLarge, NoLock> FirstFitSplit;
+typedef SmallocCore<BestFit, SplitAbove<128>, MergeNeighbours, Align<8>, NoLarge, NoLock> BestFitSplit;
+typedef SmallocCore<SegregatedFit, SplitAbove<128>, MergeNeighbours, Align<8>,
+                    MmapAbove<128 * KB>, NoLock> SegregatedNoLock;
+
+/* Random frees and allocations (some of them sreallocs) over 'live' blocks of 16B to 'max_size'. */
+template <class Heap>
+void churn(const char* name, size_t live, size_t max_size, size_t rounds) {
+    Heap* heap = new Heap();
+    void** blocks = (void**)calloc(live, sizeof(void*));
+    char* base = (char*)sbrk(0);
+    srand(1);
+
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < rounds; i++) {
+        size_t k = rand() % live;
+        size_t size = 16 + rand() % max_size;
+        if (blocks[k] != nullptr && rand() % 4 == 0) {
+            blocks[k] = heap->srealloc(blocks[k], size);
+        } else {
+            heap->sfree(blocks[k]);
+            blocks[k] = heap->smalloc(size);
+        }
+        assert(blocks[k] != nullptr);
+        *(char*)blocks[k] = 1;
+    }
+    double ms = elapsed_ms(start);
+    printf("  %-18s %8.1f ms, heap grew %7zu KB, %6zu free blocks left\n", name, ms,
+           (size_t)((char*)sbrk(0) - base) / KB, heap->_num_free_blocks());
+
+    for (size_t k = 0; k < live; k++) {
+        heap->sfree(blocks[k]);
+    }
+    free(blocks);
+    delete heap;
+}
+
+template <class Heap>
+void churnSizes(const char* name) {
+    churn<Heap>(name, 2000, 4 * KB, 200000);
+}
+
+/*******************************************************************************
+ *  BENCHMARKS
+ ******************************************************************************/
+
+/* The variants and the steps between them, on the same requests. */
+void bench_policies() {
+    churnSizes<Malloc2>("malloc_2");
+    churnSizes<FirstFitSplit>("first fit + split");
+    churnSizes<BestFitSplit>("best fit + split");
+    churnSizes<Malloc3>("malloc_3");
+    churnSizes<SegregatedNoLock>("segregated, align");
+    churnSizes<SegregatedLocked>("segregated, locked");
+}
+
+/* What the mutex costs a single thread. */
+void bench_locking() {
+    churn<SegregatedNoLock>("no lock", 2000, 1 * KB, 500000);
+    churn<SegregatedLocked>("mutex", 2000, 1 * KB, 500000);
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+struct Benchmark {
+    const char* name;
+    void (*func)();
+};
+
+static const Benchmark BENCHMARKS[] = {
+    {"policies", bench_policies},
+    {"locking", bench_locking},
+};
+
+static void callBenchFunction(const Benchmark &bench) {
+    std::cout << bench.name << std::endl;
+    if (!fork()) {  // bench as son, to get a clear heap
+        bench.func();
+        exit(0);
+    } else {		// father waits for son before continuing to next bench
+        int exit_status = 0;
+        wait(&exit_status);
+        if (exit_status)
+            std::cout << "*** FAILED with exit status " << exit_status << std::endl;
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    for (const Benchmark &bench : BENCHMARKS) {
+        if (argc < 2 || strstr(bench.name, argv[1]))
+            callBenchFunction(bench);
+    }
+    return 0;
+}
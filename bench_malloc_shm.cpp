@@ -0,0 +1,177 @@
+/*
+HOW TO RUN?
+	g++ -O2 -std=c++17 -pthread bench_malloc_shm.cpp -o bench_malloc_shm
+	./bench_malloc_shm            (runs every benchmark)
+	./bench_malloc_shm <name>     (runs only the benchmarks whose name contains <name>)
+
+NOTE: every benchmark runs in a child process, which forks the producer it measures against.
+ */
+
+#include "malloc_shm.cpp"
+#include <unistd.h>
+#include <assert.h>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <sched.h>
+#include <sys/wait.h>
+#include <iostream>
+
+/*******************************************************************************
+ *  AUXILIARY FUNCTIONS
+ ******************************************************************************/
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsed_ms(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+/* What the consumer does with a message: looks at one byte in every cache line. */
+size_t consume(const char* message, size_t size) {
+    size_t sum = 0;
+    for (size_t i = 0; i < size; i += 64) {
+        sum += message[i];
+    }
+    return sum;
+}
+
+bool read_all(int fd, void* buffer, size_t size) {
+    for (size_t done = 0; done < size; ) {
+        ssize_t n = read(fd, (char*)buffer + done, size - done);
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+bool write_all(int fd, const void* buffer, size_t size) {
+    for (size_t done = 0; done < size; ) {
+        ssize_t n = write(fd, (const char*)buffer + done, size - done);
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *  BENCHMARKS
+ ******************************************************************************/
+
+const size_t TOTAL = (size_t)1024 * 1024 * KB;
+const size_t SIZES[] = {4 * KB, 64 * KB, 1024 * KB};
+
+/* The producer fills each message and writes all of it to a pipe, the consumer reads it out. */
+double pipe_copy(size_t size) {
+    size_t count = TOTAL / size;
+    int fds[2];
+    assert(pipe(fds) == 0);
+
+    Clock::time_point start = Clock::now();
+    if (fork() == 0) {
+        close(fds[0]);
+        char* message = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        for (size_t i = 0; i < count; i++) {
+            memset(message, (char)i, size);
+            assert(write_all(fds[1], message, size));
+        }
+        exit(0);
+    }
+    close(fds[1]);
+    char* message = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    for (size_t i = 0; i < count; i++) {
+        assert(read_all(fds[0], message, size));
+        assert(message[0] == (char)i);
+        consume(message, size);
+    }
+    wait(nullptr);
+    close(fds[0]);
+    munmap(message, size);
+    return elapsed_ms(start);
+}
+
+/* The producer fills each message in the shared heap and only sends its offset,
+ * the consumer reads it in place and frees it. */
+double shm_zero_copy(size_t size) {
+    size_t count = TOTAL / size;
+    ShmHeap* heap = shm_heap_create(nullptr, 64 * 1024 * KB);
+    assert(heap != nullptr);
+    int fds[2];
+    assert(pipe(fds) == 0);
+
+    Clock::time_point start = Clock::now();
+    if (fork() == 0) {
+        close(fds[0]);
+        for (size_t i = 0; i < count; i++) {
+            char* message;
+            while ((message = (char*)shm_smalloc(heap, size)) == nullptr) {
+                sched_yield();  // the heap is full until the consumer catches up
+            }
+            memset(message, (char)i, size);
+            size_t offset = shm_offset(heap, message);
+            assert(write_all(fds[1], &offset, sizeof(offset)));
+        }
+        exit(0);
+    }
+    close(fds[1]);
+    for (size_t i = 0; i < count; i++) {
+        size_t offset;
+        assert(read_all(fds[0], &offset, sizeof(offset)));
+        char* message = (char*)shm_pointer(heap, offset);
+        assert(message[0] == (char)i);
+        consume(message, size);
+        shm_sfree(heap, message);
+    }
+    wait(nullptr);
+    close(fds[0]);
+    assert(_shm_num_free_blocks(heap) == _shm_num_allocated_blocks(heap));
+    shm_heap_close(heap);
+    return elapsed_ms(start);
+}
+
+void bench_two_processes() {
+    for (size_t size : SIZES) {
+        double pipe_ms = pipe_copy(size);
+        double shm_ms = shm_zero_copy(size);
+        printf("  %5zu KB messages: pipe %6.0f MB/s, shared heap %6.0f MB/s\n", size / KB,
+               TOTAL / KB / KB / (pipe_ms / 1000), TOTAL / KB / KB / (shm_ms / 1000));
+        fflush(stdout);  // the producers forked next would print it again
+    }
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+struct Benchmark {
+    const char* name;
+    void (*func)();
+};
+
+static const Benchmark BENCHMARKS[] = {
+    {"two_processes", bench_two_processes},
+};
+
+static void callBenchFunction(const Benchmark &bench) {
+    std::cout << bench.name << std::endl;
+    if (!fork()) {  // bench as son, to get a clear heap
+        bench.func();
+        exit(0);
+    } else {		// father waits for son before continuing to next bench
+        int exit_status = 0;
+        wait(&exit_status);
+        if (exit_status)
+            std::cout << "*** FAILED with exit status " << exit_status << std::endl;
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    for (const Benchmark &bench : BENCHMARKS) {
+        if (argc < 2 || strstr(bench.name, argv[1]))
+            callBenchFunction(bench);
+    }
+    return 0;
+}
@@ -2,7 +2,22 @@
 #include <unistd.h>
 #include <cstring>
 #include <iostream>
+#include <cassert>
+#include <cstdio>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sys/file.h>
+#include <csignal>
+#include <ctime>
+#include <atomic>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "os_malloc.h"
 
 #define MIN_SIZE 0
 #define MAX_SIZE 100000000
@@ -10,25 +25,660 @@
 #define KB 1024
 #define LARGE_ALLOC 128 * KB
 #define MD_SIZE sizeof(MetaData)
+#define REGION_CHUNK 64 * KB
+#define TREE_MIN KB
+#define SBRK_CHUNK_MIN 64 * KB
+#define SBRK_CHUNK_MAX 1024 * KB
+#define SEGMENT_SIZE (4 * 1024 * KB)
+#define MMAP_THRESHOLD_MIN 32 * KB
+#define MMAP_THRESHOLD_MAX 32 * 1024 * KB
+#define MMAP_SHORT_LIVED 64
+#define MAX_NODES 16
+#define STREAM_THRESHOLD_DEFAULT 4 * 1024 * KB
+#define STREAM_THRESHOLD_MIN KB
+#define GROW_AFTER 2
+#define PURGE_MIN 64 * KB
+#define DEFER_MAX KB
+#define DEFER_BLOCKS 256
+#define BATCH_SORT_MAX 256
+#define PERSIST_BASE ((char*)0x600000000000)
+#define PERSIST_MAGIC 0x5045525349535432ULL
+#define GROWS_MAX 255
+#define PAGE_SHIFT 12
+#define PAGEMAP_LEAF_BITS 18
+#define PAGEMAP_ROOT_BITS (48 - PAGE_SHIFT - PAGEMAP_LEAF_BITS)
+#define STARTMAP_WORD_SHIFT 9
+#define STARTMAP_LEAF_WORDS (1 << (PAGEMAP_LEAF_BITS + PAGE_SHIFT - STARTMAP_WORD_SHIFT))
+#define TRIM_MIN 128 * KB
+#define TRIM_PAD 64 * KB
+#define MAINTENANCE_PURGE_MAX 4 * 1024 * KB
+#define MAINTENANCE_PURGE_BLOCKS 256
+#define MAINTENANCE_DECAY_MS 250
+#define PRESSURE_USAGE_DEFAULT 90
+#define PRESSURE_PSI_DEFAULT 1000
+#define PRESSURE_RELAX 10
+#define PRESSURE_ROOT_MAX 256
+#define CACHE_HOOKS_MAX 8
+
+#ifdef SMALLOC_SEGMENTS
+#define HEAP_BACKEND_DEFAULT HEAP_SEGMENTS
+#else
+#define HEAP_BACKEND_DEFAULT HEAP_SBRK
+#endif
+
+// -DSMALLOC_DEBUG checks headers and canaries and quarantines freed blocks,
+// -DSMALLOC_GUARD_PAGES adds that and ends every mmap block at an inaccessible page
+#if defined(SMALLOC_GUARD_PAGES) && !defined(SMALLOC_DEBUG)
+#define SMALLOC_DEBUG
+#endif
+
+#ifdef SMALLOC_DEBUG
+#define HEADER_MAGIC 0x5AFEB10C5AFEB10CULL
+#define FREED_MAGIC 0xF4EEDB10CF4EEDB1ULL
+#define CANARY_MAGIC 0xCA4A4F1ECA4A4F1EULL
+#define CANARY_SIZE sizeof(size_t)
+#define QUARANTINE_BLOCKS 256
+#define QUARANTINE_BYTES 4 * 1024 * KB
+#define QUARANTINE_FILL 64
+#define FREED_BYTE 0xDB
+#endif
 
 using std::memset;
 using std::memmove;
+using std::memcpy;
 
+// Heap blocks are found by address: the next block starts right after this one,
+// and a free block keeps its size in a footer so the block after it can step back
 struct MetaData { 
     size_t size;
-    bool is_free;
-    MetaData* next;
-    MetaData* prev;
+    bool is_free : 1;
+    bool is_mmap : 1;
+    bool prev_is_free : 1; // the block before is in the histogram and has a footer
+    bool is_last : 1;      // no block follows until the break, or until someone else's sbrk
+    bool is_deferred : 1;  // freed into its arena's deferred cache, not coalesced yet
+    bool is_purged : 1;    // free block whose pages the maintenance thread gave back
+    unsigned char grows;   // times srealloc had to grow the block, up to GROWS_MAX
+    unsigned int birth; // mmap blocks: alloc_clock when the block was mapped,
+                        // free heap blocks: maintenance_round when they were freed
+#ifdef SMALLOC_DEBUG
+    size_t magic;       // HEADER_MAGIC or FREED_MAGIC, xored with the address and the size
+    size_t requested;   // the bytes the caller asked for, the tail canary follows them
+#endif
     MetaData* next_free;
     MetaData* prev_free;
 };
 
+// Block counters kept up to date by the helpers, so the statistics need no walk
+struct Stats {
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t heap_blocks;
+    size_t heap_bytes;
+    size_t mmap_blocks;
+    size_t mmap_bytes;
+    size_t sbrk_calls;
+    size_t sbrk_calls_saved;
+    size_t segments;
+    size_t mmap_threshold_changes;
+    size_t realloc_copied_bytes;
+    size_t purged_bytes;
+    size_t deferred_blocks;
+    size_t deferred_bytes;
+    size_t maintenance_steps;
+    size_t trimmed_bytes;
+    size_t invalid_frees;
+    size_t pagemap_leaves;
+    size_t startmap_leaves;
+    size_t pressure_events;
+};
+
+struct Arena;
+
+// With the segments backend the heap is made of SEGMENT_SIZE aligned mappings,
+// each one starts with this header and has its own block list from 'first'
+struct Segment {
+    Segment* next;
+    Segment* prev;
+    MetaData* first;
+    size_t size;
+    Arena* arena;
+};
+
+int heap_backend = HEAP_BACKEND_DEFAULT;
 MetaData* memory_list = nullptr;
+MetaData* heap_tail = nullptr;
 MetaData* mmap_list = nullptr;
-MetaData* histogram[128];
+Stats stats;
+
+// The break grows in chunks that double from sbrk_chunk_min up to sbrk_chunk_max,
+// exact_break is where the break would be if every extension had the exact size
+size_t sbrk_chunk_min = SBRK_CHUNK_MIN;
+size_t sbrk_chunk_max = SBRK_CHUNK_MAX;
+size_t sbrk_chunk = SBRK_CHUNK_MIN;
+size_t exact_break = 0;
+
+// Blocks of mmap_threshold bytes and up are mapped on their own. Like glibc's sliding
+// threshold it rises past mmap blocks that are freed soon after they were mapped,
+// and falls when the heap can't grow. smallopt fixes it and stops the sliding.
+size_t mmap_threshold = LARGE_ALLOC;
+bool mmap_threshold_fixed = false;
+unsigned int alloc_clock = 0;
+
+// With deferred coalescing, sfree parks small heap blocks in a per-size cache that
+// smalloc takes from first. They are merged in one batch when the cache fills up,
+// or when a request finds no free block and the heap would have to grow.
+bool defer_coalescing = false;
+
+// Wake ups of the maintenance thread, it only gives back blocks that stayed free
+// for MAINTENANCE_DECAY_MS, so a burst that comes back soon finds its pages resident
+unsigned int maintenance_round = 0;
+
+// Free blocks of TREE_MIN bytes and up are kept in a treap ordered by (size, address),
+// its nodes live in the payload of the free blocks themselves
+struct TreeNode {
+    MetaData* left;
+    MetaData* right;
+    MetaData* parent;
+    size_t priority;
+};
+
+// Every NUMA node has its own arena: free lists, treap and segments. The sbrk heap
+// is a single arena, the segments backend takes new segments from the arena of the
+// calling thread's node and binds them to that node. A free block always goes back
+// to the arena of its segment.
+struct Arena {
+    MetaData* histogram[128];
+    MetaData* tree_root;
+    Segment* segment_list;
+    int node;
+    MetaData* deferred[DEFER_MAX / 8 + 1]; // freed blocks by exact size, linked by next_free
+    size_t deferred_count;
+};
+
+Arena arenas[MAX_NODES];
+Arena* arena = &arenas[0]; // the calling thread's arena, picked under the heap lock
+size_t numa_nodes = 0;     // arenas in use, 0 until the nodes are detected
+size_t real_nodes = 0;     // nodes the kernel knows, arenas past them are simulated
+thread_local int thread_node = -1;
+
+struct RegionChunk {
+    RegionChunk* next;
+    size_t used;
+    size_t capacity;
+};
+
+struct SRegion {
+    RegionChunk* first;
+    RegionChunk* current;
+    RegionChunk* last;
+    size_t chunk_size;
+    SRegion* next;
+    SRegion* prev;
+};
+
+SRegion* region_list = nullptr;
+
+// A persistent heap lives in a file mapped at the same base in every run, so the
+// pointers in its blocks stay valid. The header at the start of the file keeps
+// what the globals hold for the sbrk heap, spersist_close stores them there.
+struct PersistHeader {
+    size_t magic;
+    size_t meta_size;   // MD_SIZE of the build that wrote the file
+    char* base;         // where the file must be mapped
+    size_t capacity;    // the file's length, the heap can't grow past it
+    char* brk;          // end of the heap, kept up to date while the file is open
+    bool clean;         // spersist_close saved the state below, nothing changed since
+    MetaData* memory_list;
+    MetaData* heap_tail;
+    size_t exact_break;
+    size_t free_blocks;     // the counters of the heap's blocks, the process
+    size_t free_bytes;      // counters in 'stats' stay the current process's
+    size_t heap_blocks;
+    size_t heap_bytes;
+    size_t deferred_blocks;
+    size_t deferred_bytes;
+    Arena arena;
+    SRegion* region_list;
+    void* root;
+};
+
+PersistHeader* persist = nullptr;
+int persist_fd = -1;
+std::atomic<size_t> persist_generation{0};  // spersist_close calls so far
+
+/* ================== Tree Functions =================== */
+
+Segment* segmentOf(MetaData* md) {
+    return (Segment*)((size_t)md & ~((size_t)SEGMENT_SIZE - 1));
+}
+
+Arena* arenaOf(MetaData* md) {
+    if (heap_backend == HEAP_SEGMENTS) return segmentOf(md)->arena;
+    return &arenas[0];
+}
+
+TreeNode* node(MetaData* md) {
+    return (TreeNode*)(md + 1);
+}
+
+bool treeLess(MetaData* first, MetaData* second) {
+    return first->size < second->size || (first->size == second->size && first < second);
+}
+
+void treeReplace(MetaData* parent, MetaData* old_child, MetaData* new_child) {
+    // Hang new_child where old_child was under parent (or at the root)
+    if (parent == nullptr) {
+        arenaOf(old_child)->tree_root = new_child;
+    } else if (node(parent)->left == old_child) {
+        node(parent)->left = new_child;
+    } else {
+        node(parent)->right = new_child;
+    }
+    if (new_child != nullptr) {
+        node(new_child)->parent = parent;
+    }
+}
+
+void treeRotateUp(MetaData* md) {
+    // Move md above its parent, the (size, address) order is kept
+    MetaData* parent = node(md)->parent;
+    MetaData* grand_parent = node(parent)->parent;
+    MetaData* moved;
+    if (node(parent)->left == md) {
+        moved = node(md)->right;
+        node(parent)->left = moved;
+        node(md)->right = parent;
+    } else {
+        moved = node(md)->left;
+        node(parent)->right = moved;
+        node(md)->left = parent;
+    }
+    if (moved != nullptr) {
+        node(moved)->parent = parent;
+    }
+    node(parent)->parent = md;
+    treeReplace(grand_parent, parent, md);
+}
+
+void treeInsert(MetaData* md) {
+    TreeNode* md_node = node(md);
+    md_node->left = md_node->right = nullptr;
+    md_node->priority = (size_t)md * 0x9E3779B97F4A7C15ULL; // hashed address
+    md->next_free = md->prev_free = nullptr;
+
+    // Insert as a leaf, then rotate up until the priorities form a heap again
+    MetaData* parent = nullptr;
+    MetaData** link = &arenaOf(md)->tree_root;
+    while (*link != nullptr) {
+        parent = *link;
+        link = treeLess(md, parent) ? &node(parent)->left : &node(parent)->right;
+    }
+    *link = md;
+    md_node->parent = parent;
+
+    while (md_node->parent != nullptr && node(md_node->parent)->priority < md_node->priority) {
+        treeRotateUp(md);
+    }
+}
+
+void treeRemove(MetaData* md) {
+    TreeNode* md_node = node(md);
+
+    // Rotate md down until it has at most one child, then unlink it
+    while (md_node->left != nullptr && md_node->right != nullptr) {
+        if (node(md_node->left)->priority > node(md_node->right)->priority) {
+            treeRotateUp(md_node->left);
+        } else {
+            treeRotateUp(md_node->right);
+        }
+    }
+    treeReplace(md_node->parent, md, md_node->left != nullptr ? md_node->left : md_node->right);
+}
+
+MetaData* treeFind(size_t size) {
+    // Smallest block that fits, lowest address among equal sizes
+    MetaData* best = nullptr;
+    MetaData* md = arena->tree_root;
+    while (md != nullptr) {
+        if (md->size >= size) {
+            best = md;
+            md = node(md)->left;
+        } else {
+            md = node(md)->right;
+        }
+    }
+    return best;
+}
+
+/* ================= Page Map Functions ================ */
+
+// Every 4KB page the allocator owns has an entry in a two level radix tree indexed
+// by the page number: the mmap block, segment or arena it belongs to, tagged with
+// its kind in the low bits. A leaf covers 1GB and is mapped on first use, so the
+// whole 48 bit address space takes a 2MB root of mostly untouched pages.
+// sfree & co. look the pointer up before they trust the header in front of it.
+// Heap and segment pages also have a bit for every 8 bytes in a second tree, the
+// start map: it is set where a block header starts, so a pointer into the middle
+// of a block is told apart from the block's own. The helpers that add and remove
+// headers (linkAfter, absorbNext, sbrkBlock, segmentBlock) keep it up to date.
+
+enum PageKind { PAGE_NONE = 0, PAGE_HEAP = 1, PAGE_SEGMENT = 2, PAGE_MMAP = 3 };
+
+size_t* pagemap[1 << PAGEMAP_ROOT_BITS];
+uint64_t* startmap[1 << PAGEMAP_ROOT_BITS];
+
+size_t pageEntry(void* p) {
+    size_t page = (size_t)p >> PAGE_SHIFT;
+    if (page >> (PAGEMAP_ROOT_BITS + PAGEMAP_LEAF_BITS) != 0) return 0;
+    size_t* leaf = pagemap[page >> PAGEMAP_LEAF_BITS];
+    return leaf == nullptr ? 0 : leaf[page & ((1 << PAGEMAP_LEAF_BITS) - 1)];
+}
+
+PageKind pageKind(size_t entry) {
+    return (PageKind)(entry & 7);
+}
+
+void* pageOwner(size_t entry) {
+    return (void*)(entry & ~(size_t)7);
+}
+
+bool pagemapSet(void* start, size_t length, void* owner, PageKind kind) {
+    // Point every page that overlaps [start, start + length) at owner, or clear them
+    // with PAGE_NONE. Only fails when a leaf can't be mapped, nothing is set then
+    size_t first = (size_t)start >> PAGE_SHIFT;
+    size_t last = ((size_t)start + length - 1) >> PAGE_SHIFT;
+    if (length == 0 || last >> (PAGEMAP_ROOT_BITS + PAGEMAP_LEAF_BITS) != 0) return length == 0;
+
+    for (size_t i = first >> PAGEMAP_LEAF_BITS; kind != PAGE_NONE && i <= last >> PAGEMAP_LEAF_BITS; i++) {
+        if (pagemap[i] != nullptr) continue;
+        void* leaf = mmap(NULL, sizeof(size_t) << PAGEMAP_LEAF_BITS, PROT_READ | PROT_WRITE,
+                            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (leaf == MAP_FAILED) return false;
+        pagemap[i] = (size_t*)leaf;
+        stats.pagemap_leaves++;
+    }
+    for (size_t i = first >> PAGEMAP_LEAF_BITS; (kind == PAGE_HEAP || kind == PAGE_SEGMENT) &&
+            i <= last >> PAGEMAP_LEAF_BITS; i++) {
+        if (startmap[i] != nullptr) continue;
+        void* leaf = mmap(NULL, sizeof(uint64_t) * STARTMAP_LEAF_WORDS, PROT_READ | PROT_WRITE,
+                            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (leaf == MAP_FAILED) return false;
+        startmap[i] = (uint64_t*)leaf;
+        stats.startmap_leaves++;
+    }
+    size_t entry = (size_t)owner | kind;
+    for (size_t page = first; page <= last; page++) {
+        size_t* leaf = pagemap[page >> PAGEMAP_LEAF_BITS];
+        if (leaf != nullptr) leaf[page & ((1 << PAGEMAP_LEAF_BITS) - 1)] = entry;
+    }
+    return true;
+}
+
+uint64_t* startWord(void* md) {
+    size_t page = (size_t)md >> PAGE_SHIFT;
+    if (page >> (PAGEMAP_ROOT_BITS + PAGEMAP_LEAF_BITS) != 0) return nullptr;
+    uint64_t* leaf = startmap[page >> PAGEMAP_LEAF_BITS];
+    if (leaf == nullptr) return nullptr;
+    return &leaf[((size_t)md >> STARTMAP_WORD_SHIFT) & (STARTMAP_LEAF_WORDS - 1)];
+}
+
+uint64_t startBit(void* md) {
+    return (uint64_t)1 << (((size_t)md >> 3) & 63);
+}
+
+void markStart(MetaData* md) {
+    // The page map was set for md's pages first, so its leaf is there
+    *startWord(md) |= startBit(md);
+}
+
+void clearStart(MetaData* md) {
+    *startWord(md) &= ~startBit(md);
+}
+
+bool isStart(MetaData* md) {
+    uint64_t* word = startWord(md);
+    return word != nullptr && (*word & startBit(md)) != 0;
+}
+
+void clearStarts(char* start, char* end) {
+    // Every header in [start, end) is gone, start is STARTMAP_WORD_SHIFT aligned
+    for (char* at = start; at < end; at += 1 << STARTMAP_WORD_SHIFT) {
+        uint64_t* word = startWord(at);
+        if (word != nullptr) *word = 0;
+    }
+}
+
+MetaData* blockOf(void* p) {
+    // The header of the block at p, or nullptr if p isn't one of ours: an mmap
+    // block must be the payload of its mapping, a heap block's header must be
+    // in the start map
+    if (p == nullptr || (size_t)p % 8 != 0) return nullptr;
+    size_t entry = pageEntry(p);
+    MetaData* md = (MetaData*)p - 1;
+    switch (pageKind(entry)) {
+        case PAGE_MMAP:
+            return (MetaData*)pageOwner(entry) == md ? md : nullptr;
+        case PAGE_SEGMENT:
+        case PAGE_HEAP:
+            return isStart(md) ? md : nullptr;
+        default:
+            return nullptr;
+    }
+}
+
+/* =================== Copy Functions ================== */
+
+// Copies and zeroing of stream_threshold bytes and up (half the last level cache)
+// use non-temporal stores, so a big scalloc or srealloc doesn't flush the cache.
+// The widest vectors the CPU has are picked once, smaller sizes use memcpy/memset.
+
+size_t stream_threshold = 0;
+void (*stream_copy)(char* dst, const char* src, size_t n) = nullptr;
+void (*stream_zero)(char* dst, size_t n) = nullptr;
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx512f")))
+void streamCopyAvx512(char* dst, const char* src, size_t n) {
+    // Plain copy up to a 64 byte aligned destination, then stream whole vectors.
+    // Too few bytes for one round of vectors are copied plainly
+    size_t head = (64 - ((size_t)dst & 63)) & 63;
+    if (n < head + 256) {
+        memcpy(dst, src, n);
+        return;
+    }
+    memcpy(dst, src, head);
+    dst += head, src += head, n -= head;
+    for (; n >= 256; n -= 256, dst += 256, src += 256) {
+        __m512i a = _mm512_loadu_si512(src);
+        __m512i b = _mm512_loadu_si512(src + 64);
+        __m512i c = _mm512_loadu_si512(src + 128);
+        __m512i d = _mm512_loadu_si512(src + 192);
+        _mm512_stream_si512((__m512i*)dst, a);
+        _mm512_stream_si512((__m512i*)(dst + 64), b);
+        _mm512_stream_si512((__m512i*)(dst + 128), c);
+        _mm512_stream_si512((__m512i*)(dst + 192), d);
+    }
+    _mm_sfence();
+    memcpy(dst, src, n);
+}
+
+__attribute__((target("avx512f")))
+void streamZeroAvx512(char* dst, size_t n) {
+    size_t head = (64 - ((size_t)dst & 63)) & 63;
+    if (n < head + 256) {
+        memset(dst, 0, n);
+        return;
+    }
+    memset(dst, 0, head);
+    dst += head, n -= head;
+    __m512i zero = _mm512_setzero_si512();
+    for (; n >= 256; n -= 256, dst += 256) {
+        _mm512_stream_si512((__m512i*)dst, zero);
+        _mm512_stream_si512((__m512i*)(dst + 64), zero);
+        _mm512_stream_si512((__m512i*)(dst + 128), zero);
+        _mm512_stream_si512((__m512i*)(dst + 192), zero);
+    }
+    _mm_sfence();
+    memset(dst, 0, n);
+}
+
+__attribute__((target("avx2")))
+void streamCopyAvx2(char* dst, const char* src, size_t n) {
+    size_t head = (32 - ((size_t)dst & 31)) & 31;
+    if (n < head + 128) {
+        memcpy(dst, src, n);
+        return;
+    }
+    memcpy(dst, src, head);
+    dst += head, src += head, n -= head;
+    for (; n >= 128; n -= 128, dst += 128, src += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)src);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(src + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(src + 96));
+        _mm256_stream_si256((__m256i*)dst, a);
+        _mm256_stream_si256((__m256i*)(dst + 32), b);
+        _mm256_stream_si256((__m256i*)(dst + 64), c);
+        _mm256_stream_si256((__m256i*)(dst + 96), d);
+    }
+    _mm_sfence();
+    memcpy(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+void streamZeroAvx2(char* dst, size_t n) {
+    size_t head = (32 - ((size_t)dst & 31)) & 31;
+    if (n < head + 128) {
+        memset(dst, 0, n);
+        return;
+    }
+    memset(dst, 0, head);
+    dst += head, n -= head;
+    __m256i zero = _mm256_setzero_si256();
+    for (; n >= 128; n -= 128, dst += 128) {
+        _mm256_stream_si256((__m256i*)dst, zero);
+        _mm256_stream_si256((__m256i*)(dst + 32), zero);
+        _mm256_stream_si256((__m256i*)(dst + 64), zero);
+        _mm256_stream_si256((__m256i*)(dst + 96), zero);
+    }
+    _mm_sfence();
+    memset(dst, 0, n);
+}
+
+// SSE2 is part of x86-64, so this one always works
+void streamCopySse2(char* dst, const char* src, size_t n) {
+    size_t head = (16 - ((size_t)dst & 15)) & 15;
+    if (n < head + 64) {
+        memcpy(dst, src, n);
+        return;
+    }
+    memcpy(dst, src, head);
+    dst += head, src += head, n -= head;
+    for (; n >= 64; n -= 64, dst += 64, src += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)src);
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+        _mm_stream_si128((__m128i*)dst, a);
+        _mm_stream_si128((__m128i*)(dst + 16), b);
+        _mm_stream_si128((__m128i*)(dst + 32), c);
+        _mm_stream_si128((__m128i*)(dst + 48), d);
+    }
+    _mm_sfence();
+    memcpy(dst, src, n);
+}
+
+void streamZeroSse2(char* dst, size_t n) {
+    size_t head = (16 - ((size_t)dst & 15)) & 15;
+    if (n < head + 64) {
+        memset(dst, 0, n);
+        return;
+    }
+    memset(dst, 0, head);
+    dst += head, n -= head;
+    __m128i zero = _mm_setzero_si128();
+    for (; n >= 64; n -= 64, dst += 64) {
+        _mm_stream_si128((__m128i*)dst, zero);
+        _mm_stream_si128((__m128i*)(dst + 16), zero);
+        _mm_stream_si128((__m128i*)(dst + 32), zero);
+        _mm_stream_si128((__m128i*)(dst + 48), zero);
+    }
+    _mm_sfence();
+    memset(dst, 0, n);
+}
+
+#else
+
+void streamCopyPlain(char* dst, const char* src, size_t n) {
+    memcpy(dst, src, n);
+}
+
+void streamZeroPlain(char* dst, size_t n) {
+    memset(dst, 0, n);
+}
+
+#endif
+
+void initCopyKernels() {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx512f")) {
+        stream_copy = streamCopyAvx512;
+        stream_zero = streamZeroAvx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        stream_copy = streamCopyAvx2;
+        stream_zero = streamZeroAvx2;
+    } else {
+        stream_copy = streamCopySse2;
+        stream_zero = streamZeroSse2;
+    }
+#else
+    stream_copy = streamCopyPlain;
+    stream_zero = streamZeroPlain;
+#endif
+
+    if (stream_threshold == 0) {
+        long cache = sysconf(_SC_LEVEL3_CACHE_SIZE);
+        stream_threshold = cache > 0 ? (size_t)cache / 2 : STREAM_THRESHOLD_DEFAULT;
+    }
+}
+
+void copyBlock(void* dst, const void* src, size_t n) {
+    // dst and src never overlap: the data moves to a block of its own
+    if (stream_copy == nullptr) initCopyKernels();
+    if (n < stream_threshold) {
+        memcpy(dst, src, n);
+    } else {
+        stream_copy((char*)dst, (const char*)src, n);
+    }
+}
+
+void zeroBlock(void* dst, size_t n) {
+    if (stream_zero == nullptr) initCopyKernels();
+    if (n < stream_threshold) {
+        memset(dst, 0, n);
+    } else {
+        stream_zero((char*)dst, n);
+    }
+}
 
 /* ================= Helper Functions ================== */
 
+char* blockEnd(MetaData* md) {
+    return (char*)(md + 1) + md->size;
+}
+
+MetaData* nextBlock(MetaData* md) {
+    return md->is_last ? nullptr : (MetaData*)blockEnd(md);
+}
+
+MetaData* prevBlock(MetaData* md) {
+    // Only a free previous block can be found, through its footer
+    if (!md->prev_is_free) return nullptr;
+    size_t prev_size = *((size_t*)md - 1);
+    return (MetaData*)((char*)md - prev_size - MD_SIZE);
+}
+
 int histIndex (size_t size) {
     int i = 0;
     while (i < 128) {
@@ -41,11 +691,24 @@ int histIndex (size_t size) {
 }
 
 void histRemove(MetaData* md){
+    // Whoever takes the block next starts its own growth count
+    md->grows = 0;
+    MetaData* next_block = nextBlock(md);
+    if (next_block != nullptr) {
+        next_block->prev_is_free = false;
+    }
+    stats.free_blocks--;
+    stats.free_bytes -= md->size;
+
+    if (md->size >= TREE_MIN) {
+        treeRemove(md);
+        return;
+    }
     if (md->prev_free != nullptr) {
         md->prev_free->next_free = md->next_free;
     } else {
         int index = histIndex(md->size);
-        histogram[index] = md->next_free;
+        arenaOf(md)->histogram[index] = md->next_free;
     }
     if (md->next_free != nullptr) {
         md->next_free->prev_free = md->prev_free;
@@ -54,7 +717,23 @@ void histRemove(MetaData* md){
 }
 
 void histInsert (MetaData* md) {
+    // Leave the boundary tag for the next block, the block's pages are in use
+    md->is_purged = false;
+    md->birth = maintenance_round;
+    *(size_t*)(blockEnd(md) - sizeof(size_t)) = md->size;
+    MetaData* next_block = nextBlock(md);
+    if (next_block != nullptr) {
+        next_block->prev_is_free = true;
+    }
+    stats.free_blocks++;
+    stats.free_bytes += md->size;
+
+    if (md->size >= TREE_MIN) {
+        treeInsert(md);
+        return;
+    }
     int index = histIndex(md->size);
+    MetaData** histogram = arenaOf(md)->histogram;
     MetaData* slot = histogram[index];
     
     if (slot == nullptr) {
@@ -94,7 +773,57 @@ void histInsert (MetaData* md) {
     }
 }
 
+MetaData* histFind(size_t size) {
+    // The sorted lists come first, the first block that fits is the best fit
+    for (int i = histIndex(size); i < histIndex(TREE_MIN); i++) {
+        for (MetaData* md = arena->histogram[i]; md != nullptr; md = md->next_free) {
+            if (md->size >= size) {
+                return md;
+            }
+        }
+    }
+    return treeFind(size);
+}
+
+void linkAfter(MetaData* md, MetaData* new_block) {
+    // new_block was cut from the end of md, which is not in the histogram
+    new_block->is_mmap = false;
+    new_block->prev_is_free = false;
+    new_block->is_last = md->is_last;
+    new_block->grows = 0;
+    new_block->is_deferred = false;
+    md->is_last = false;
+    if (heap_tail == md) {
+        heap_tail = new_block;
+    }
+    markStart(new_block);
+    stats.heap_blocks++;
+    stats.heap_bytes -= MD_SIZE;
+}
+
+void absorbNext(MetaData* md) {
+    // Grow md over the block that follows it
+    MetaData* next_block = nextBlock(md);
+    md->size += next_block->size + MD_SIZE;
+    md->is_last = next_block->is_last;
+    if (heap_tail == next_block) {
+        heap_tail = md;
+    }
+    clearStart(next_block);
+    stats.heap_blocks--;
+    stats.heap_bytes += MD_SIZE;
+}
+
+void settleFree(MetaData* md);
+
 void split(MetaData* metaData, size_t requested_size) {
+    // Reaching past the exact-size break means a chunk's surplus saved an sbrk
+    size_t requested_end = (size_t)(metaData + 1) + requested_size;
+    if (heap_backend == HEAP_SBRK && requested_end > exact_break) {
+        exact_break = requested_end;
+        stats.sbrk_calls_saved++;
+    }
+
     if(metaData->size - requested_size < SPLIT_MIN + MD_SIZE) {
         return;
     }
@@ -102,92 +831,196 @@ void split(MetaData* metaData, size_t requested_size) {
     MetaData* newMataData = (MetaData*)((size_t)metaData + MD_SIZE + requested_size);
     newMataData->size = metaData->size - requested_size - MD_SIZE;
     newMataData->is_free = true;
-    newMataData->prev = metaData;
-    newMataData->next = metaData->next;
-    if (newMataData->next != nullptr) {
-        newMataData->next->prev = newMataData;
-    }
+    linkAfter(metaData, newMataData);
     metaData->size = requested_size;
-    metaData->next = newMataData;
     histInsert(newMataData);
+    settleFree(newMataData);
 }
 
-void merge(MetaData* metaData) {
+MetaData* merge(MetaData* metaData) {
     // Merge with next block if it's free
-    MetaData* next_block = metaData->next;
+    MetaData* next_block = nextBlock(metaData);
     if (next_block != nullptr && next_block->is_free) {
         histRemove(metaData);
         histRemove(next_block);
-        metaData->size += next_block->size + MD_SIZE;
-        metaData->next = next_block->next;
-        if (next_block->next != nullptr) {
-            next_block->next->prev = metaData;
-        }
+        absorbNext(metaData);
         histInsert(metaData);
     }
 
     // Merge with previous block if it's free
-    MetaData* prev_block = metaData->prev;
+    MetaData* prev_block = prevBlock(metaData);
     if (prev_block != nullptr && prev_block->is_free) {
         histRemove(prev_block);
         histRemove(metaData);
-        prev_block->size += metaData->size + MD_SIZE;
-        prev_block->next = metaData->next;
-        if (metaData->next != nullptr) {
-            metaData->next->prev = prev_block;
-        }
+        absorbNext(prev_block);
         histInsert(prev_block);
+        return prev_block;
     }
+    return metaData;
 }
 
 void* mmap_smalloc(size_t size) {
     // Allocate large memory for meta-data and 'size' bytes using mmap
-    void* mm_block = mmap(NULL, size + MD_SIZE, PROT_READ | PROT_WRITE,
+    size_t length = size + MD_SIZE;
+#ifdef SMALLOC_GUARD_PAGES
+    size_t page = getpagesize();
+    length = (length + page - 1) / page * page + page;
+#endif
+    void* mm_block = mmap(NULL, length, PROT_READ | PROT_WRITE,
                             MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
     if (mm_block == MAP_FAILED) 
         return nullptr;
+#ifdef SMALLOC_GUARD_PAGES
+    // The block ends right where the guard page starts, so an overflow faults at once
+    mprotect((char*)mm_block + length - page, page, PROT_NONE);
+    mm_block = (char*)mm_block + length - page - size - MD_SIZE;
+#endif
     
     MetaData* metaData = (MetaData*)mm_block;
+    if (!pagemapSet(metaData, size + MD_SIZE, metaData, PAGE_MMAP)) {
+#ifdef SMALLOC_GUARD_PAGES
+        mm_block = (char*)mm_block + size + MD_SIZE + page - length;
+#endif
+        munmap(mm_block, length);
+        return nullptr;
+    }
     metaData->size = size;
     metaData->is_free = false;
+    metaData->is_mmap = true;
+    metaData->prev_is_free = false;
+    metaData->is_last = true;
+    metaData->grows = 0;
+    metaData->is_deferred = false;
+    metaData->birth = alloc_clock;
 
-    // Insert new block to mmap_list
-    if (!mmap_list) {
-        mmap_list = metaData;
-        metaData->next = metaData->prev = nullptr;
-    }
-    else {
-        MetaData* md = mmap_list;
-        while (md->next) {
-            md = md->next;
-        }
-        metaData->prev = md;
-        md->next = metaData;
+    // Insert new block to mmap_list, mmap blocks reuse the free list links
+    metaData->prev_free = nullptr;
+    metaData->next_free = mmap_list;
+    if (mmap_list != nullptr) {
+        mmap_list->prev_free = metaData;
     }
+    mmap_list = metaData;
+    stats.mmap_blocks++;
+    stats.mmap_bytes += size;
 
     return metaData + 1;
 }
 
-void* mmap_srealloc(void* oldp, size_t size) {
-    MetaData* old_md = (MetaData*)oldp - 1;
+void setMmapThreshold(size_t threshold) {
+    if (threshold != mmap_threshold) {
+        mmap_threshold = threshold;
+        stats.mmap_threshold_changes++;
+    }
+}
+
+size_t mmapThresholdMax() {
+    // Blocks under the threshold come from the heap, so they must fit in a segment
+    if (heap_backend == HEAP_SEGMENTS) return SEGMENT_SIZE - sizeof(Segment) - MD_SIZE;
+    return MMAP_THRESHOLD_MAX;
+}
 
-    // Remove old block from mmap list
-    if (old_md->next != nullptr) {
-         old_md->next->prev = old_md->prev;
+void raiseMmapThreshold(MetaData* md) {
+    // A mapping that lived for only a few allocations should have been a heap block
+    if (mmap_threshold_fixed || md->size < mmap_threshold || md->size >= mmapThresholdMax())
+        return;
+    if (alloc_clock - md->birth < MMAP_SHORT_LIVED) {
+        setMmapThreshold(md->size + 8);
     }
-    if (old_md->prev != nullptr) {
-        old_md->prev->next = old_md->next;
-    } else {
-        mmap_list = old_md->next;
+}
+
+void lowerMmapThreshold() {
+    // Under memory pressure large blocks go back to mmap, where sfree returns them
+    if (mmap_threshold_fixed) return;
+    size_t threshold = mmap_threshold / 2;
+    setMmapThreshold(threshold < MMAP_THRESHOLD_MIN ? MMAP_THRESHOLD_MIN : threshold);
+}
+
+unsigned char grownCount(MetaData* md) {
+    // srealloc has to make the block bigger once more
+    return md->grows < GROWS_MAX ? md->grows + 1 : GROWS_MAX;
+}
+
+size_t growTarget(size_t size, unsigned char grows) {
+    // A block that keeps growing gets half as much again, so its copies add up to O(n)
+    if (grows < GROW_AFTER) return size;
+    size_t target = size + size / 16 * 8;
+    if (target > MAX_SIZE) target = MAX_SIZE;
+    // The reserve alone doesn't turn a heap block into a mapping
+    if (size < mmap_threshold && target >= mmap_threshold) target = mmap_threshold - 8;
+    return target;
+}
+
+bool keepsReserve(MetaData* md, size_t size) {
+    // A growing block that shrinks a little keeps its slack for the next growth
+    return md->grows >= GROW_AFTER && size > md->size / 2;
+}
+
+void mmap_release(MetaData* md) {
+    // Remove block from mmap list and give its pages back
+    if (md->next_free != nullptr) {
+        md->next_free->prev_free = md->prev_free;
     }
-    // Reallocate memory for new size and free old block 
-    void* newp = mmap_smalloc(size);
-    if (size < old_md->size) {
-        memmove(newp, oldp, size);
+    if (md->prev_free != nullptr) {
+        md->prev_free->next_free = md->next_free;
     } else {
-        memmove(newp, oldp, old_md->size);
+        mmap_list = md->next_free;
+    }
+    stats.mmap_blocks--;
+    stats.mmap_bytes -= md->size;
+    pagemapSet(md, md->size + MD_SIZE, nullptr, PAGE_NONE);
+#ifdef SMALLOC_GUARD_PAGES
+    size_t page = getpagesize();
+    char* start = (char*)((size_t)md / page * page);
+    munmap(start, blockEnd(md) + page - start);
+#else
+    munmap(md, md->size + MD_SIZE);
+#endif
+}
+
+void mmap_sfree(MetaData* md) {
+    raiseMmapThreshold(md);
+    mmap_release(md);
+}
+
+void* mmap_shrink(void* oldp, size_t size) {
+    // Unmap the pages past the new end, the block stays where it is
+    MetaData* md = (MetaData*)oldp - 1;
+    if (keepsReserve(md, size))
+        return oldp;
+
+    size_t page = getpagesize();
+    size_t length = (md->size + MD_SIZE + page - 1) / page * page;
+    size_t kept = (size + MD_SIZE + page - 1) / page * page;
+    if (kept < length) {
+        pagemapSet((char*)md + kept, length - kept, nullptr, PAGE_NONE);
+        munmap((char*)md + kept, length - kept);
     }
-    munmap(oldp, old_md->size + MD_SIZE);
+    stats.mmap_bytes -= md->size - size;
+    md->size = size;
+    md->grows = 0;
+    return oldp;
+}
+
+void* mmap_srealloc(void* oldp, size_t size) {
+    MetaData* old_md = (MetaData*)oldp - 1;
+    if (old_md->size >= size && keepsReserve(old_md, size))
+        return oldp;
+    unsigned char grows = old_md->size < size ? grownCount(old_md) : 0;
+    size_t target = growTarget(size, grows);
+
+    // Reallocate memory for new size and free old block 
+    void* newp = mmap_smalloc(target);
+    if (!newp && target > size)
+        newp = mmap_smalloc(size);
+    if (!newp)
+        return nullptr;
+    ((MetaData*)newp - 1)->grows = grows;
+
+    // The data lives on in the new mapping, so this doesn't move the threshold
+    size_t copied = size < old_md->size ? size : old_md->size;
+    copyBlock(newp, oldp, copied);
+    stats.realloc_copied_bytes += copied;
+    mmap_release(old_md);
     return newp;
 }
 
@@ -195,151 +1028,863 @@ void align_memory(size_t* size){
     *size += ((8 - (*size % 8)) % 8);
 }
 
-/* ================ Upgraded Functions ================= */
-
-void* smalloc(size_t size) {
-    // Update size for memory alignment
-    align_memory(&size);
-    
-    if (size <= MIN_SIZE || size > MAX_SIZE) 
-        return nullptr;
+MetaData* wilderness() {
+    // Segments have a fixed size, only the sbrk heap has a block that can grow
+    return heap_backend == HEAP_SBRK ? heap_tail : nullptr;
+}
 
-    if (size >= LARGE_ALLOC)
-        return mmap_smalloc(size);
+void* heapSbrk(size_t increment) {
+    // A persistent heap grows inside its file, the process break is left alone
+    if (persist == nullptr) return sbrk(increment);
+    if (increment > (size_t)(persist->base + persist->capacity - persist->brk))
+        return (void*)(-1);
+    void* start = persist->brk;
+    persist->brk += increment;
+    return start;
+}
 
-    // First, search for free space in memory list
-    if (memory_list) {
-        // Check if histogram has a free block with enough space
-        for (int i = histIndex(size); i < 128; i++) {
-            MetaData* md = histogram[i];
-            while (md != nullptr) {
-                if (md->size >= size) {
-                    md->is_free = false;
-                    histRemove(md);
-                    split(md, size); // alignement is preserved
-                    return md + 1;
-                }
-                md = md->next_free;
-            }       
+void* chunkSbrk(size_t needed, size_t* grown) {
+    // Extend the break by at least a chunk, or by exactly 'needed' if that fails
+    size_t request = needed < sbrk_chunk ? sbrk_chunk : needed;
+    void* start = heapSbrk(request);
+    if (start == (void*)(-1) && request > needed) {
+        request = needed;
+        start = heapSbrk(request);
+    }
+    if (start == (void*)(-1))
+        return nullptr;
+    if (!pagemapSet(start, request, &arenas[0], PAGE_HEAP)) {
+        // Give the break back, unless someone moved it since
+        if (heapSbrk(0) == (char*)start + request) {
+            if (persist != nullptr) persist->brk -= request;
+            else sbrk(-(intptr_t)request);
         }
+        return nullptr;
+    }
 
-        // Check if wilderness chunck is free
-        MetaData* wild = memory_list;
-        while (wild->next) {
-            wild = wild->next;
-        }
-        if (wild->is_free /*true dat*/) {
-            histRemove(wild);
-            wild->is_free = false; //bummer
-            void* enlarge = sbrk(size - wild->size); // alignment is preserved
-            if (enlarge == (void*)(-1))
-                return nullptr;
-            
-            wild->size = size;
-            return wild + 1;
-        }
+    stats.sbrk_calls++;
+    exact_break = (size_t)start + needed;
+    if (sbrk_chunk != 0 && sbrk_chunk < sbrk_chunk_max) {
+        sbrk_chunk = sbrk_chunk * 2 < sbrk_chunk_max ? sbrk_chunk * 2 : sbrk_chunk_max;
     }
+    *grown = request;
+    return start;
+}
 
-    // If not enough free space was found, allocate new memory
-    MetaData* metaData = (MetaData*)sbrk(size + sizeof(MetaData));
-    if (metaData == (void*)(-1)) {
+bool growTail(size_t delta) {
+    // The wilderness can only grow if nobody else moved the break since,
+    // it may grow by more than delta, the caller splits off the surplus
+    size_t grown;
+    if (heapSbrk(0) != blockEnd(heap_tail) || chunkSbrk(delta, &grown) == nullptr)
+        return false;
+
+    heap_tail->size += grown;
+    stats.heap_bytes += grown;
+    return true;
+}
+
+MetaData* sbrkBlock(size_t size) {
+    // Allocate a new block of 'size' bytes at the end of the heap
+    size_t grown;
+    MetaData* metaData = (MetaData*)chunkSbrk(size + MD_SIZE, &grown);
+    if (metaData == nullptr) {
         return nullptr;
     }
 
-    metaData->size = size;
+    metaData->size = grown - MD_SIZE;
     metaData->is_free = false;
-    metaData->next = metaData->prev = nullptr;
+    metaData->is_mmap = false;
+    metaData->prev_is_free = false;
+    metaData->is_last = true;
+    metaData->grows = 0;
+    metaData->is_deferred = false;
+    markStart(metaData);
+    stats.heap_blocks++;
+    stats.heap_bytes += metaData->size;
 
-    // Add the allocated meta-data to memory list
     if (!memory_list) {
         memory_list = metaData;
     }
-    else {
-        MetaData* last = memory_list;
-        while (last->next) {
-            last = last->next;
-        }
-        last->next = metaData;
-        metaData->prev = last;
+    // Blocks are only neighbours if nobody else moved the break in between
+    else if ((char*)metaData == blockEnd(heap_tail)) {
+        heap_tail->is_last = false;
+        metaData->prev_is_free = heap_tail->is_free;
+    }
+    heap_tail = metaData;
+
+    // The surplus of the chunk stays as a free wilderness block
+    split(metaData, size);
+    return metaData;
+}
+
+void bindNode(void* addr, size_t length, int node) {
+    // Prefer the node's memory for the pages, without failing when it runs out.
+    // Simulated nodes have no memory of their own, they keep the default policy
+    if ((size_t)node >= real_nodes) return;
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {};
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, addr, length, MPOL_PREFERRED, mask, MAX_NODES + 1, 0);
+}
+
+MetaData* segmentBlock(size_t size) {
+    // Map twice the size and trim it, so the segment is aligned to its size
+    char* mapped = (char*)mmap(NULL, 2 * SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+                                MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mapped == MAP_FAILED)
+        return nullptr;
+
+    char* base = (char*)(((size_t)mapped + SEGMENT_SIZE - 1) & ~((size_t)SEGMENT_SIZE - 1));
+    if (base != mapped) {
+        munmap(mapped, base - mapped);
+    }
+    munmap(base + SEGMENT_SIZE, mapped + SEGMENT_SIZE - base);
+    if (!pagemapSet(base, SEGMENT_SIZE, base, PAGE_SEGMENT)) {
+        munmap(base, SEGMENT_SIZE);
+        return nullptr;
+    }
+
+    // Bind the pages before the first touch, then add the segment to the arena's list
+    bindNode(base, SEGMENT_SIZE, arena->node);
+    Segment* segment = (Segment*)base;
+    segment->size = SEGMENT_SIZE;
+    segment->arena = arena;
+    segment->prev = nullptr;
+    segment->next = arena->segment_list;
+    if (arena->segment_list != nullptr) {
+        arena->segment_list->prev = segment;
+    }
+    arena->segment_list = segment;
+    stats.segments++;
+
+    // The whole segment is one block, the part not requested stays free
+    MetaData* metaData = (MetaData*)(segment + 1);
+    metaData->size = SEGMENT_SIZE - sizeof(Segment) - MD_SIZE;
+    metaData->is_free = false;
+    metaData->is_mmap = false;
+    metaData->prev_is_free = false;
+    metaData->is_last = true;
+    metaData->grows = 0;
+    metaData->is_deferred = false;
+    segment->first = metaData;
+    markStart(metaData);
+    stats.heap_blocks++;
+    stats.heap_bytes += metaData->size;
+
+    split(metaData, size);
+    return metaData;
+}
+
+void releaseSegment(MetaData* md) {
+    // A free block that fills its whole segment gives the segment back
+    if (heap_backend != HEAP_SEGMENTS || !md->is_free) return;
+
+    Segment* segment = segmentOf(md);
+    if (segment->first != md || !md->is_last) return;
+
+    histRemove(md);
+    clearStart(md);
+    stats.heap_blocks--;
+    stats.heap_bytes -= md->size;
+
+    // Remove the segment from segment list
+    if (segment->next != nullptr) {
+        segment->next->prev = segment->prev;
+    }
+    if (segment->prev != nullptr) {
+        segment->prev->next = segment->next;
+    } else {
+        segment->arena->segment_list = segment->next;
+    }
+    stats.segments--;
+    pagemapSet(segment, segment->size, nullptr, PAGE_NONE);
+    munmap(segment, segment->size);
+}
+
+void settleFree(MetaData* md) {
+    // A block that became free outside sfree (the rest of a split) merges with its
+    // free neighbours too, so no two free blocks touch. A segment whose blocks all
+    // coalesced is released
+    md = merge(md);
+    if (heap_backend == HEAP_SEGMENTS) {
+        releaseSegment(md);
+    }
+}
+
+MetaData* newBlock(size_t size) {
+    // Take fresh memory from the configured backend
+    if (heap_backend == HEAP_SEGMENTS) return segmentBlock(size);
+    return sbrkBlock(size);
+}
+
+/* =================== NUMA Functions ================== */
+
+void detectNodes() {
+    // The online nodes are listed like "0" or "0-1,3", the last one is the highest
+    real_nodes = 1;
+    int fd = open("/sys/devices/system/node/online", O_RDONLY);
+    if (fd >= 0) {
+        char buffer[128];
+        ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+        close(fd);
+        size_t last = 0;
+        for (ssize_t i = 0; i < length; i++) {
+            if (buffer[i] >= '0' && buffer[i] <= '9') {
+                last = last * 10 + (buffer[i] - '0');
+            } else {
+                if (buffer[i] == '-' || buffer[i] == ',') last = 0;
+                continue;
+            }
+            real_nodes = last + 1;
+        }
+    }
+    if (real_nodes > MAX_NODES) real_nodes = MAX_NODES;
+    if (numa_nodes == 0) numa_nodes = real_nodes;
+
+    for (int node = 0; node < MAX_NODES; node++) {
+        arenas[node].node = node;
+    }
+}
+
+Arena* threadArena() {
+    // The sbrk heap can't be split by node
+    if (heap_backend != HEAP_SEGMENTS) return &arenas[0];
+    if (numa_nodes == 0) detectNodes();
+    if (numa_nodes == 1) return &arenas[0];
+
+    // A bound thread keeps its node, the others follow the CPU they run on.
+    // With simulated nodes the CPU number spreads the threads instead
+    if (thread_node >= 0) return &arenas[thread_node % numa_nodes];
+    unsigned int cpu = 0, node = 0;
+    getcpu(&cpu, &node);
+    if (numa_nodes > real_nodes) node = cpu;
+    return &arenas[node % numa_nodes];
+}
+
+int smalloc_bind_node(int node) {
+    if (node < -1 || node >= MAX_NODES) return 0;
+    thread_node = node;
+    return 1;
+}
+
+/* ================= Locking Functions ================= */
+
+// One mutex guards the whole allocator: the public functions take it, the
+// locked_* ones expect the caller to hold it. A signal handler that calls in
+// while its thread holds the mutex fails (nullptr, or a leaked sfree) instead
+// of deadlocking or walking a half updated list.
+
+pthread_mutex_t heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+thread_local bool heap_owner = false;
+
+void heapLock() {
+    // The thread counts as the owner from before it waits for the mutex until after
+    // it let go of it, a handler that runs in between backs off instead of waiting
+    heap_owner = true;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    pthread_mutex_lock(&heap_mutex);
+}
+
+void heapUnlock() {
+    pthread_mutex_unlock(&heap_mutex);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    heap_owner = false;
+}
+
+struct HeapLock {
+    bool held;
+
+    HeapLock() : held(!heap_owner) {
+        if (held) {
+            heapLock();
+            arena = threadArena();
+        }
+    }
+
+    ~HeapLock() {
+        if (held) {
+            heapUnlock();
+        }
+    }
+};
+
+// The maintenance thread does the housekeeping a request shouldn't pay for: it
+// trims the wilderness, purges big free blocks and merges the deferred caches.
+// Only what stayed free for MAINTENANCE_DECAY_MS is trimmed or purged.
+// It waits on maintenance_cond with the heap mutex, so a step only runs between
+// requests. It wakes every maintenance_interval ms, or when sfree crosses a threshold.
+pthread_t maintenance_thread;
+pthread_cond_t maintenance_cond = PTHREAD_COND_INITIALIZER;
+bool maintenance_running = false;
+bool maintenance_wanted = false;
+size_t maintenance_interval = 0;
+
+// The pressure monitor compares the cgroup's memory.current with its memory.max,
+// and reads the share of time tasks stalled on memory from /proc/pressure/memory
+// (PSI "some avg10", kept in hundredths of a percent). Over either threshold the
+// heap gives back what it can: the deferred frees are merged, the wilderness is
+// trimmed, every big free block is purged, the mmap threshold halves and the break
+// grows from its smallest chunk again. Then the cache hooks run, with the lock
+// held, to ask the caches above the heap (smalloc_fixed's) to drain. Pressure ends
+// once usage drops PRESSURE_RELAX points and PSI to half under their thresholds,
+// then the mmap threshold is put back. spersist_close runs the same hooks, so the
+// caches forget the blocks of the file it unmapped.
+// The maintenance thread checks every interval, smalloc_pressure_check on demand.
+// The files are read under pressure_root, so tests can point it at a fake sysfs.
+char pressure_root[PRESSURE_ROOT_MAX] = "";
+size_t pressure_usage = PRESSURE_USAGE_DEFAULT; // percent of memory.max, 0 ignores usage
+size_t pressure_psi = PRESSURE_PSI_DEFAULT;     // hundredths of a percent, 0 ignores PSI
+bool under_pressure = false;
+size_t pressure_threshold = 0;                  // mmap_threshold before the pressure
+void (*cache_hooks[CACHE_HOOKS_MAX])(int event) = {};
+size_t cache_hook_count = 0;
+
+void runCacheHooks(int event) {
+    // Under the heap lock: the hooks may only mark their caches, not call smalloc
+    for (size_t i = 0; i < cache_hook_count; i++) {
+        cache_hooks[i](event);
+    }
+}
+
+void maintenanceWake() {
+    if (maintenance_running && !maintenance_wanted) {
+        maintenance_wanted = true;
+        pthread_cond_signal(&maintenance_cond);
+    }
+}
+
+void forkPrepare() {
+    // Quiesce the allocator, so the child gets a heap no thread is changing
+    heapLock();
+}
+
+void forkParent() {
+    heapUnlock();
+}
+
+void forkChild() {
+    // Only the forking thread lives on, it starts with fresh locks
+    pthread_mutex_init(&heap_mutex, nullptr);
+    heap_owner = false;
+
+    // The maintenance thread isn't copied, the child runs without one until it starts its own
+    pthread_cond_init(&maintenance_cond, nullptr);
+    maintenance_running = maintenance_wanted = false;
+
+    // A persistent heap is shared with the parent through the file, the child
+    // moves a private copy of it in its place and lets go of the file
+    if (persist != nullptr) {
+        size_t used = persist->brk - persist->base;
+        void* copy = mmap(NULL, persist->capacity, PROT_READ | PROT_WRITE,
+                            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (copy != MAP_FAILED) {
+            memcpy(copy, persist->base, used);
+            mremap(copy, persist->capacity, persist->capacity,
+                    MREMAP_MAYMOVE | MREMAP_FIXED, persist->base);
+        }
+        close(persist_fd);
+        persist_fd = -1;
+    }
+}
+
+int fork_handlers = pthread_atfork(forkPrepare, forkParent, forkChild);
+
+/* ================ Deferred Functions ================= */
+
+void locked_sfree_batch(void** ptrs, size_t count);
+void mergeFree(MetaData* md);
+
+void deferredFlush(Arena* owner) {
+    // Hand every deferred block of the arena to the batch free, which coalesces
+    // them in a single pass sorted by address
+    MetaData* blocks[DEFER_BLOCKS + 1];
+    size_t count = 0;
+    for (size_t i = 0; i <= DEFER_MAX / 8; i++) {
+        for (MetaData* md = owner->deferred[i]; md != nullptr; md = md->next_free) {
+            md->is_deferred = false;
+            blocks[count++] = md + 1;
+            stats.deferred_blocks--;
+            stats.deferred_bytes -= md->size;
+        }
+        owner->deferred[i] = nullptr;
+    }
+    owner->deferred_count = 0;
+#ifdef SMALLOC_DEBUG
+    // The blocks already passed the debug checks and the quarantine
+    for (size_t i = 0; i < count; i++) {
+        mergeFree((MetaData*)blocks[i] - 1);
+    }
+#else
+    locked_sfree_batch((void**)blocks, count);
+#endif
+}
+
+void deferredFlushAll() {
+    for (size_t i = 0; i < MAX_NODES; i++) {
+        if (arenas[i].deferred_count > 0) deferredFlush(&arenas[i]);
+    }
+}
+
+void deferFree(MetaData* md) {
+    // Park the block in its size's list, the neighbours still see it as allocated
+    Arena* owner = arenaOf(md);
+    md->is_deferred = true;
+    md->next_free = owner->deferred[md->size / 8];
+    owner->deferred[md->size / 8] = md;
+    owner->deferred_count++;
+    stats.deferred_blocks++;
+    stats.deferred_bytes += md->size;
+
+    if (owner->deferred_count > DEFER_BLOCKS) {
+        deferredFlush(owner);
+    } else if (owner->deferred_count == DEFER_BLOCKS / 2) {
+        maintenanceWake();
+    }
+}
+
+MetaData* deferredTake(size_t size) {
+    // Reuse a deferred block of exactly this size, nothing to split or merge
+    if (size > DEFER_MAX || arena->deferred[size / 8] == nullptr) return nullptr;
+
+    MetaData* md = arena->deferred[size / 8];
+    arena->deferred[size / 8] = md->next_free;
+    arena->deferred_count--;
+    md->is_deferred = false;
+    md->grows = 0;
+    md->next_free = nullptr;
+    stats.deferred_blocks--;
+    stats.deferred_bytes -= md->size;
+    return md;
+}
+
+/* ================= Tuning Functions ================== */
+
+int smallopt(int param, size_t value) {
+    HeapLock lock;
+    if (!lock.held) return 0;
+
+    switch (param) {
+        case SMALLOPT_SBRK_CHUNK_MIN:
+            align_memory(&value);
+            // 0 turns chunking off, the break then grows by exact sizes
+            if (value > sbrk_chunk_max) return 0;
+            sbrk_chunk_min = sbrk_chunk = value;
+            return 1;
+        case SMALLOPT_SBRK_CHUNK_MAX:
+            align_memory(&value);
+            if (value < sbrk_chunk_min) return 0;
+            sbrk_chunk_max = value;
+            if (sbrk_chunk > value) sbrk_chunk = value;
+            return 1;
+        case SMALLOPT_HEAP_BACKEND:
+            // The backend can only change before the heap has any block
+            if ((value != HEAP_SBRK && value != HEAP_SEGMENTS) ||
+                    memory_list != nullptr || stats.segments != 0) return 0;
+            heap_backend = (int)value;
+            if (mmap_threshold > mmapThresholdMax()) {
+                setMmapThreshold(mmapThresholdMax());
+            }
+            return 1;
+        case SMALLOPT_NUMA_NODES:
+            // More arenas than real nodes simulates them, before the heap has any block
+            if (value == 0 || value > MAX_NODES ||
+                    memory_list != nullptr || stats.segments != 0) return 0;
+            if (real_nodes == 0) detectNodes();
+            numa_nodes = value;
+            return 1;
+        case SMALLOPT_STREAM_THRESHOLD:
+            // 0 goes back to half the last level cache. Streaming a few hundred
+            // bytes only costs, smaller thresholds are refused
+            if (value != 0 && value < STREAM_THRESHOLD_MIN) return 0;
+            stream_threshold = value;
+            initCopyKernels();
+            return 1;
+        case SMALLOPT_MMAP_THRESHOLD:
+            // 0 goes back to the sliding threshold, from its default. Below
+            // MMAP_THRESHOLD_MIN every block would be a mapping
+            align_memory(&value);
+            if ((value != 0 && value < MMAP_THRESHOLD_MIN) || value > mmapThresholdMax()) return 0;
+            mmap_threshold_fixed = value != 0;
+            setMmapThreshold(value != 0 ? value : LARGE_ALLOC);
+            return 1;
+        case SMALLOPT_PRESSURE_USAGE:
+            // Percent of memory.max, 0 ignores the usage
+            if (value > 100) return 0;
+            pressure_usage = value;
+            return 1;
+        case SMALLOPT_PRESSURE_PSI:
+            // Hundredths of a percent of PSI "some avg10", 0 ignores PSI
+            if (value > 10000) return 0;
+            pressure_psi = value;
+            return 1;
+        case SMALLOPT_DEFERRED_COALESCING:
+            // Turning it off merges what is still deferred
+            if (value > 1) return 0;
+            defer_coalescing = value;
+            if (!defer_coalescing) deferredFlushAll();
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* ================ Upgraded Functions ================= */
+
+void* locked_smalloc(size_t size);
+void locked_sfree(void* p);
+
+MetaData* reuseFree(size_t size) {
+    // Check if histogram has a free block with enough space
+    MetaData* md = histFind(size);
+    if (md != nullptr) {
+        md->is_free = false;
+        histRemove(md);
+        split(md, size); // alignement is preserved
+        return md;
+    }
+
+    // Check if wilderness chunck is free
+    MetaData* wild = wilderness();
+    if (wild != nullptr && wild->is_free /*true dat*/) {
+        histRemove(wild);
+        if (growTail(size - wild->size)) { // alignment is preserved
+            wild->is_free = false; //bummer
+            split(wild, size);
+            return wild;
+        }
+        histInsert(wild);
+    }
+    return nullptr;
+}
+
+void* plain_smalloc(size_t size) {
+    // Update size for memory alignment
+    align_memory(&size);
+    
+    if (size <= MIN_SIZE || size > MAX_SIZE) 
+        return nullptr;
+
+    alloc_clock++;
+    if (size >= mmap_threshold)
+        return mmap_smalloc(size);
+
+    // First, search for free space in memory list
+    if (memory_list || stats.segments) {
+        MetaData* md = deferredTake(size);
+        if (md == nullptr) {
+            md = reuseFree(size);
+        }
+        // A miss coalesces the deferred blocks, they may make room before the heap grows
+        if (md == nullptr && arena->deferred_count > 0) {
+            deferredFlush(arena);
+            md = reuseFree(size);
+        }
+        if (md != nullptr) {
+            return md + 1;
+        }
+    }
+
+    // If not enough free space was found, allocate new memory
+    MetaData* metaData = newBlock(size);
+    if (metaData == nullptr) {
+        // The heap can't grow, a lower threshold may let mmap serve this block
+        lowerMmapThreshold();
+        if (size >= mmap_threshold)
+            return mmap_smalloc(size);
+        return nullptr;
     }
 
     return metaData + 1;
 }
 
+void* smalloc(size_t size) {
+    HeapLock lock;
+    if (!lock.held) return nullptr;
+
+    return locked_smalloc(size);
+}
+
 void* scalloc(size_t num, size_t size) {
-    // First, align and allocate memory using smalloc
+    HeapLock lock;
+    if (!lock.held) return nullptr;
+
+    // First, align and allocate memory using smalloc. A product that overflows is too big
+    if (size != 0 && num > MAX_SIZE / size) return nullptr;
     size_t alloc_size = num * size;
-    align_memory(alloc_size);
-    void* alloc_addr = smalloc(alloc_size);
+    align_memory(&alloc_size);
+    void* alloc_addr = locked_smalloc(alloc_size);
     if (!alloc_addr) return nullptr;
 
-    // Then, if allocation succeeds, reset the block
-    else return memset(alloc_addr, 0, alloc_size);
+    // Then, if allocation succeeds, reset the block. A new mapping is zeroed already
+    if (!((MetaData*)alloc_addr - 1)->is_mmap) {
+        zeroBlock(alloc_addr, alloc_size);
+    }
+    return alloc_addr;
 }
 
-void sfree(void* p) {
+void mergeFree(MetaData* md) {
+    // Add the allocated block to free histogram and merge it with its neighbours
+    md->is_free = true;
+    histInsert(md);
+    md = merge(md);
+    if (md->size >= TRIM_MIN) {
+        maintenanceWake();
+    }
+    releaseSegment(md); // alignement is preserved
+}
+
+void heap_sfree(MetaData* md) {
+    if (defer_coalescing && md->size <= DEFER_MAX) {
+        deferFree(md);
+        return;
+    }
+    mergeFree(md);
+}
+
+void plain_sfree(void* p) {
     if (!p) return;
     
-    MetaData* md = (MetaData*)p - 1;
-    if (md->is_free) return;
+    MetaData* md = blockOf(p);
+    if (md == nullptr) {
+        stats.invalid_frees++;
+        return;
+    }
+    if (md->is_free || md->is_deferred) return;
 
     // If p is in memory_list, add the allocated block to free histogram
-    else if (md->size < LARGE_ALLOC) {
-        md->is_free = true; 
-        histInsert(md);
-        merge(md); // alignement is preserved
+    else if (!md->is_mmap) {
+        heap_sfree(md);
     }
     // Else if p is in mmap_list, free the allocated block using munmap
     else {
-        if (md->next != nullptr) {
-            md->next->prev = md->prev;
-        }
-        if (md->prev != nullptr) {
-            md->prev->next = md->next;
-        } else {
-            mmap_list = md->next;
-        }
-        munmap(p, md->size + MD_SIZE);
+        mmap_sfree(md);
     }
 }
 
-void* srealloc(void* oldp, size_t size) {
-    // Update size for memory alignment
-    align_memory(&size);
+/* ================== Debug Functions ================== */
 
-    if (size <= MIN_SIZE || size > MAX_SIZE) 
+#ifdef SMALLOC_DEBUG
+
+// Freed heap blocks wait in a FIFO before they really go back to the histogram,
+// filled with FREED_BYTE. Until then they still count as allocated blocks
+MetaData* quarantine[QUARANTINE_BLOCKS];
+size_t quarantine_head = 0;
+size_t quarantine_count = 0;
+size_t quarantine_bytes = 0;
+
+void corruption(const char* what, void* p) {
+    char message[128];
+    int length = snprintf(message, sizeof(message), "smalloc: %s at %p\n", what, p);
+    write(STDERR_FILENO, message, length);
+    abort();
+}
+
+void writeCanary(MetaData* md) {
+    size_t canary = CANARY_MAGIC ^ (size_t)md;
+    memcpy((char*)(md + 1) + md->requested, &canary, CANARY_SIZE);
+}
+
+MetaData* checkedHeader(void* p) {
+    // Don't trust the header before its magic and the canary after the block check out
+    if ((size_t)p % 8 != 0) corruption("misaligned pointer", p);
+    if (blockOf(p) == nullptr) corruption("pointer not allocated by smalloc", p);
+    MetaData* md = (MetaData*)p - 1;
+    if (md->magic == (FREED_MAGIC ^ (size_t)md ^ md->size)) corruption("double free", p);
+    if (md->magic != (HEADER_MAGIC ^ (size_t)md ^ md->size) || md->is_free) {
+        corruption("corrupted header", p);
+    }
+
+    size_t canary = CANARY_MAGIC ^ (size_t)md;
+    if (memcmp((char*)p + md->requested, &canary, CANARY_SIZE) != 0) {
+        corruption("tail canary overwritten", p);
+    }
+    return md;
+}
+
+void* debugAlloc(size_t size) {
+    if (size <= MIN_SIZE || size > MAX_SIZE) return nullptr;
+
+    // Room for the canary comes on top of the caller's bytes
+    void* p = plain_smalloc(size + CANARY_SIZE);
+    if (!p) return nullptr;
+
+    MetaData* md = (MetaData*)p - 1;
+    md->magic = HEADER_MAGIC ^ (size_t)md ^ md->size;
+    md->requested = size;
+    writeCanary(md);
+    return p;
+}
+
+void quarantineEvict() {
+    MetaData* md = quarantine[quarantine_head];
+    quarantine_head = (quarantine_head + 1) % QUARANTINE_BLOCKS;
+    quarantine_count--;
+    quarantine_bytes -= md->size;
+
+    // A changed fill means the block was written after it was freed
+    unsigned char* payload = (unsigned char*)(md + 1);
+    size_t fill = md->size < QUARANTINE_FILL ? md->size : QUARANTINE_FILL;
+    for (size_t i = 0; i < fill; i++) {
+        if (payload[i] != FREED_BYTE) corruption("write after free", payload);
+    }
+    plain_sfree(payload);
+}
+
+void quarantineFlush() {
+    while (quarantine_count > 0) {
+        quarantineEvict();
+    }
+}
+
+void debugFree(void* p, size_t size_hint = 0) {
+    // A sized free's size (0 for sfree) can't be more than was requested
+    if (!p) return;
+
+    MetaData* md = checkedHeader(p);
+    if (size_hint > md->requested) corruption("sized free larger than the block", p);
+    md->magic = FREED_MAGIC ^ (size_t)md ^ md->size;
+
+    // mmap blocks are unmapped at once, any later access faults anyway
+    if (md->is_mmap) {
+        plain_sfree(p);
+        return;
+    }
+
+    memset(p, FREED_BYTE, md->size < QUARANTINE_FILL ? md->size : QUARANTINE_FILL);
+    while (quarantine_count == QUARANTINE_BLOCKS ||
+            (quarantine_count > 0 && quarantine_bytes + md->size > QUARANTINE_BYTES)) {
+        quarantineEvict();
+    }
+    quarantine[(quarantine_head + quarantine_count) % QUARANTINE_BLOCKS] = md;
+    quarantine_count++;
+    quarantine_bytes += md->size;
+}
+
+void* debugRealloc(void* oldp, size_t size, size_t old_size_hint = 0) {
+    // The block always moves, so stale pointers to the old one land in the quarantine
+    if (oldp == nullptr) return debugAlloc(size);
+
+    MetaData* old_md = checkedHeader(oldp);
+    align_memory(&old_size_hint);
+    if (old_size_hint > old_md->requested + 7) corruption("sized realloc larger than the block", oldp);
+    void* newp = debugAlloc(size);
+    if (!newp) return nullptr;
+
+    copyBlock(newp, oldp, size < old_md->requested ? size : old_md->requested);
+    debugFree(oldp);
+    return newp;
+}
+
+#endif
+
+void* locked_smalloc(size_t size) {
+#ifdef SMALLOC_DEBUG
+    return debugAlloc(size);
+#else
+    return plain_smalloc(size);
+#endif
+}
+
+void locked_sfree(void* p) {
+#ifdef SMALLOC_DEBUG
+    debugFree(p);
+#else
+    plain_sfree(p);
+#endif
+}
+
+void sfree(void* p) {
+    HeapLock lock;
+    if (!lock.held) return;
+
+    locked_sfree(p);
+}
+
+void* move_srealloc(void* oldp, size_t size) {
+    // Move the data to a block of the other kind (heap <-> mmap)
+    MetaData* old_md = (MetaData*)oldp - 1;
+    unsigned char grows = old_md->size < size ? grownCount(old_md) : 0;
+    size_t target = growTarget(size, grows);
+    void* newp = locked_smalloc(target);
+    if (!newp && target > size)
+        newp = locked_smalloc(size);
+    if (!newp)
         return nullptr;
+    ((MetaData*)newp - 1)->grows = grows;
 
-    // If oldp is null, allocate memory for 'size' bytes and return a pointer to it
-    if (oldp == nullptr) return smalloc(size);
+    size_t copied = size < old_md->size ? size : old_md->size;
+    copyBlock(newp, oldp, copied);
+    stats.realloc_copied_bytes += copied;
+    locked_sfree(oldp);
+    return newp;
+}
+
+void purgePages(void* start, void* end) {
+    // Drop the whole pages between start and end, they read back as zeros
+    size_t page = getpagesize();
+    size_t first = ((size_t)start + page - 1) / page * page;
+    size_t last = (size_t)end / page * page;
+    if (last > first && madvise((void*)first, last - first, MADV_DONTNEED) == 0) {
+        stats.purged_bytes += last - first;
+    }
+}
+
+void shrinkBlock(MetaData* md, size_t size) {
+    // The freed tail joins a free successor, even one too small to split off alone
+    MetaData* next_block = nextBlock(md);
+    if (next_block != nullptr && next_block->is_free &&
+            md->size - size + next_block->size >= SPLIT_MIN) {
+        histRemove(next_block);
+        absorbNext(md);
+    }
+
+    // A big tail gives its pages back, except the ones under the free block's
+    // header, tree node and boundary tag
+    char* tail = (char*)(md + 1) + size;
+    if (blockEnd(md) - tail >= PURGE_MIN) {
+        purgePages(tail + MD_SIZE + sizeof(TreeNode), blockEnd(md) - sizeof(size_t));
+    }
+    split(md, size); // alignement is preserved
+}
 
-    if (size >= LARGE_ALLOC) return mmap_srealloc(oldp, size);
+void splitGrown(MetaData* md, size_t target) {
+    // md holds at least the size asked for, keep up to 'target' of it for the next growth
+    split(md, target < md->size ? target : md->size);
+}
 
+void* heap_srealloc(void* oldp, size_t size) {
     MetaData* old_md = (MetaData*) oldp - 1;
-    MetaData* prev_block = old_md->prev;
-    MetaData* next_block = old_md->next;
+    MetaData* prev_block = prevBlock(old_md);
+    MetaData* next_block = nextBlock(old_md);
 
     // Check if old block has enough memory to support the new block size
     if (old_md->size >= size) {
         old_md->is_free = false;
-        split(old_md, size); // alignement is preserved
+        if (keepsReserve(old_md, size))
+            return oldp;
+        old_md->grows = 0;
+        if (old_md->size > size) {
+            shrinkBlock(old_md, size);
+        }
         return oldp;
     }
+
+    // The block must grow, a block that keeps growing takes room for the next time too
+    unsigned char grows = grownCount(old_md);
+    size_t target = growTarget(size, grows);
     
     // If not, check if merging with PREVIOUS block is sufficient 
-    else if (prev_block != nullptr && prev_block->is_free && 
+    if (prev_block != nullptr && prev_block->is_free && 
                 prev_block->size + old_md->size + MD_SIZE >= size) {
         // Remove previous block from free histogram and merge with old block
         histRemove(prev_block);
         prev_block->is_free = false;
-        prev_block->size += old_md->size + MD_SIZE;
-        prev_block->next = old_md->next;
-        if (old_md->next != nullptr) {
-            old_md->next->prev = prev_block;
-        }
-        // Copy the data, then split the merged block
-        memmove(prev_block + 1, oldp, old_md->size);
-        split(prev_block, size); // alignement is preserved
+        absorbNext(prev_block);
+        prev_block->grows = grows;
+        // Copy the data, then split the merged block (the move overwrites old_md)
+        size_t copied = old_md->size;
+        memmove(prev_block + 1, oldp, copied);
+        stats.realloc_copied_bytes += copied;
+        splitGrown(prev_block, target); // alignement is preserved
         return prev_block + 1;
     }
 
@@ -349,13 +1894,10 @@ void* srealloc(void* oldp, size_t size) {
         // Remove next block from free histogram and merge with old block
         histRemove(next_block);
         next_block->is_free = false;
-        old_md->size += next_block->size + MD_SIZE;
-        old_md->next = next_block->next;
-        if (next_block->next != nullptr) {
-            next_block->next->prev = old_md;
-        }
+        absorbNext(old_md);
+        old_md->grows = grows;
         // Split the merged block
-        split(old_md, size); // alignement is preserved
+        splitGrown(old_md, target); // alignement is preserved
         return old_md + 1;
     }
     
@@ -367,100 +1909,1145 @@ void* srealloc(void* oldp, size_t size) {
         histRemove(prev_block);
         histRemove(next_block);
         prev_block->is_free = next_block->is_free = false;
-        prev_block->size += old_md->size + next_block->size + 2*MD_SIZE;
-        prev_block->next = next_block->next;
-        if (next_block->next != nullptr) {
-            next_block->next->prev = prev_block;
-        }
-        // Copy the data, then split the merged block
-        memmove(prev_block + 1, oldp, old_md->size);
-        split(prev_block, size); // alignement is preserved
+        absorbNext(prev_block);
+        absorbNext(prev_block);
+        prev_block->grows = grows;
+        // Copy the data, then split the merged block (the move overwrites old_md)
+        size_t copied = old_md->size;
+        memmove(prev_block + 1, oldp, copied);
+        stats.realloc_copied_bytes += copied;
+        splitGrown(prev_block, target); // alignement is preserved
         return prev_block + 1;
     }
 
     // If not, check if reallocation is in wilderness block and enlarge it
-    else if (old_md->next == nullptr) {
-        void* enlarge = sbrk(size - old_md->size);
-        if (enlarge == (void*)(-1))
-            return nullptr;
-            
-        old_md->size = size;
+    else if (old_md == wilderness() && (growTail(target - old_md->size) ||
+                (target > size && growTail(size - old_md->size)))) {
+        old_md->grows = grows;
+        splitGrown(old_md, target); // alignement is preserved
         return old_md + 1;
     }
 
     // If not, allocate memory using smalloc
     else {
-        void* realloc_addr = smalloc(size);
+        void* realloc_addr = locked_smalloc(target);
+        if (!realloc_addr && target > size)
+            realloc_addr = locked_smalloc(size);
         if (!realloc_addr) 
             return nullptr;
+        ((MetaData*)realloc_addr - 1)->grows = grows;
         
         // Copy the data, then free the old memory using sfree
-        memmove(realloc_addr, oldp, old_md->size);
+        copyBlock(realloc_addr, oldp, old_md->size);
+        stats.realloc_copied_bytes += old_md->size;
         histInsert(old_md);
         old_md->is_free = true;
+        settleFree(old_md);
         return realloc_addr;
     }
 }
 
 
-size_t _num_free_blocks() {
-    size_t free_blocks = 0;
-    for (int i = 0; i < 128; i++) {
-        MetaData* md = histogram[i];
-        while (md != nullptr) {
-            free_blocks++;
-            md = md->next_free;
-        }
+void* resize(void* oldp, bool is_mmap, size_t size) {
+    // Pick the path by the kind of the old block and the kind of the new one.
+    // Shrinking never moves a block, except a mapping cut below MMAP_THRESHOLD_MIN
+    size_t old_size = ((MetaData*)oldp - 1)->size;
+    if (is_mmap) {
+        if (size <= old_size && size >= MMAP_THRESHOLD_MIN) return mmap_shrink(oldp, size);
+        if (size >= mmap_threshold) return mmap_srealloc(oldp, size);
+        return move_srealloc(oldp, size);
     }
-    return free_blocks;
+    if (size >= mmap_threshold && size > old_size) return move_srealloc(oldp, size);
+    return heap_srealloc(oldp, size);
 }
 
-size_t _num_free_bytes() {
-    size_t free_bytes = 0;
-    for (int i = 0; i < 128; i++) {
-        MetaData* md = histogram[i];
-        while (md != nullptr) {
-            free_bytes += md->size;
-            md = md->next_free;
-        }
+void* locked_srealloc(void* oldp, size_t size, size_t old_size_hint) {
+    // Update size for memory alignment
+    align_memory(&size);
+
+    if (size <= MIN_SIZE || size > MAX_SIZE) 
+        return nullptr;
+
+#ifdef SMALLOC_DEBUG
+    return debugRealloc(oldp, size, old_size_hint);
+#else
+    (void)old_size_hint;
+#endif
+
+    // If oldp is null, allocate memory for 'size' bytes and return a pointer to it
+    if (oldp == nullptr) return locked_smalloc(size);
+
+    MetaData* old_md = blockOf(oldp);
+    if (old_md == nullptr) {
+        stats.invalid_frees++;
+        return nullptr;
     }
-    return free_bytes;
+    return resize(oldp, old_md->is_mmap, size);
 }
 
-size_t _num_allocated_blocks() {
-    size_t allocated_blocks = 0;
-    if (memory_list) {
-        for (MetaData* md = memory_list; md != nullptr; md = md->next) {
-            allocated_blocks++;
-        }
-    }
-    if (mmap_list) {
-        for (MetaData* md = mmap_list; md != nullptr; md = md->next) {
-            allocated_blocks++;
-        }
-    }
-    return allocated_blocks;
+void* srealloc(void* oldp, size_t size) {
+    HeapLock lock;
+    if (!lock.held) return nullptr;
+
+    return locked_srealloc(oldp, size, 0);
 }
 
-size_t _num_allocated_bytes() {
-    size_t allocated_bytes = 0;
-    if (memory_list) {
-        for (MetaData* md = memory_list; md != nullptr; md = md->next) {
-            allocated_bytes += md->size;
-        }
-    }
-    if (mmap_list) {
-        for (MetaData* md = mmap_list; md != nullptr; md = md->next) {
-            allocated_bytes += md->size;
-        }
-    }
-    return allocated_bytes;
+/* ================== Sized Functions ================== */
+
+// The caller's size saves no lookup: the mmap threshold moves, so a size can't tell
+// which path the block took. The header picks it, the size is checked in debug builds
+
+void sfree_sized(void* p, size_t size) {
+    HeapLock lock;
+    if (!lock.held) return;
+
+#ifdef SMALLOC_DEBUG
+    debugFree(p, size);
+#else
+    (void)size;
+    plain_sfree(p);
+#endif
 }
 
-size_t _size_meta_data() {
-    return sizeof(MetaData);
+void* srealloc_sized(void* oldp, size_t old_size, size_t size) {
+    HeapLock lock;
+    if (!lock.held) return nullptr;
+
+    return locked_srealloc(oldp, size, old_size);
 }
 
-size_t _num_meta_data_bytes() {
-    return _num_allocated_blocks() * _size_meta_data();
+/* ================ In-place Functions ================= */
+
+size_t mmap_capacity(MetaData* md) {
+    // Mappings are whole pages, the tail of the last page is usable slack
+    size_t page = getpagesize();
+    return (md->size + MD_SIZE + page - 1) / page * page - MD_SIZE;
+}
+
+size_t usableSize(MetaData* md) {
+    if (md->is_mmap) return mmap_capacity(md);
+    return md->size;
+}
+
+size_t smalloc_usable_size(void* p) {
+    HeapLock lock;
+    if (!lock.held) return 0;
+
+    if (!p) return 0;
+#ifdef SMALLOC_DEBUG
+    // Only the requested bytes, the rest of the block belongs to the canary
+    return checkedHeader(p)->requested;
+#endif
+    MetaData* md = blockOf(p);
+    return md != nullptr ? usableSize(md) : 0;
+}
+
+size_t mmap_expand(MetaData* md, size_t min_size, size_t max_size) {
+    size_t page = getpagesize();
+    size_t old_len = mmap_capacity(md) + MD_SIZE;
+
+    // Try to grow the mapping without moving it, first to max then to min
+    if (min_size + MD_SIZE > old_len) {
+        size_t new_len = (max_size + MD_SIZE + page - 1) / page * page;
+        if (mremap(md, old_len, new_len, 0) == MAP_FAILED) {
+            new_len = (min_size + MD_SIZE + page - 1) / page * page;
+            if (mremap(md, old_len, new_len, 0) == MAP_FAILED)
+                return 0;
+            max_size = min_size;
+        }
+        if (!pagemapSet(md, new_len, md, PAGE_MMAP)) {
+            mremap(md, new_len, old_len, 0);
+            return 0;
+        }
+    }
+    else if (max_size + MD_SIZE > old_len) {
+        max_size = old_len - MD_SIZE;
+    }
+
+    stats.mmap_bytes += max_size - md->size;
+    md->size = max_size;
+    return mmap_capacity(md);
+}
+
+size_t sexpand_inplace(void* p, size_t min_size, size_t max_size) {
+    HeapLock lock;
+    if (!lock.held) return 0;
+
+    // Update sizes for memory alignment
+    align_memory(&min_size);
+    align_memory(&max_size);
+    if (max_size < min_size) max_size = min_size;
+
+    if (!p || min_size > MAX_SIZE) return 0;
+    if (max_size > MAX_SIZE) max_size = MAX_SIZE;
+
+#ifdef SMALLOC_DEBUG
+    // The canary sits right after the requested bytes, the block can't grow past them
+    size_t requested = checkedHeader(p)->requested;
+    return min_size <= requested ? requested : 0;
+#endif
+
+    // Check if the block's own slack is enough
+    MetaData* md = blockOf(p);
+    if (md == nullptr) return 0;
+    if (md->size >= min_size) return usableSize(md);
+
+    if (md->is_mmap) return mmap_expand(md, min_size, max_size);
+    size_t old_size = md->size;
+
+    // Check if merging with NEXT block is sufficient, or if it leads to the wilderness
+    MetaData* next_block = nextBlock(md);
+    if (next_block != nullptr && next_block->is_free &&
+            (md->size + next_block->size + MD_SIZE >= min_size || next_block == wilderness())) {
+        histRemove(next_block);
+        absorbNext(md);
+    }
+
+    // Check if the block is the wilderness and enlarge it, first to max then to min
+    if (md->size < min_size && md == wilderness()) {
+        if (!growTail(max_size - md->size)) {
+            growTail(min_size - md->size);
+        }
+    }
+
+    if (md->size < min_size) {
+        // Give back the merged next block if the wilderness could not grow
+        split(md, old_size);
+        return 0;
+    }
+
+    split(md, max_size < md->size ? max_size : md->size); // alignement is preserved
+    return md->size;
+}
+
+/* ================== Batch Functions ================== */
+
+void carve(MetaData* md, size_t size, size_t count, void** out) {
+    // Cut 'count' back to back blocks of 'size' bytes out of a removed free block,
+    // only the last one may give its leftover back to the histogram
+    for (size_t i = 0; i < count; i++) {
+        md->is_free = false;
+        md->next_free = md->prev_free = nullptr;
+        out[i] = md + 1;
+        if (i + 1 == count) {
+            split(md, size); // alignement is preserved
+            break;
+        }
+
+        MetaData* next_block = (MetaData*)((size_t)md + MD_SIZE + size);
+        next_block->size = md->size - size - MD_SIZE;
+        linkAfter(md, next_block);
+        md->size = size;
+        md = next_block;
+    }
+}
+
+int compareAddress(const void* a, const void* b) {
+    size_t first = (size_t)*(void* const*)a;
+    size_t second = (size_t)*(void* const*)b;
+    return (first > second) - (first < second);
+}
+
+size_t smalloc_batch(size_t size, size_t count, void** out) {
+    HeapLock lock;
+    if (!lock.held) return 0;
+
+    // Update size for memory alignment
+    align_memory(&size);
+
+    if (size <= MIN_SIZE || size > MAX_SIZE || count == 0 || out == nullptr)
+        return 0;
+
+#ifdef SMALLOC_DEBUG
+    // Every block needs its own header magic and canary
+    for (size_t i = 0; i < count; i++) {
+        out[i] = locked_smalloc(size);
+        if (out[i] == nullptr) {
+            locked_sfree_batch(out, i);
+            return 0;
+        }
+    }
+    return count;
+#endif
+
+    // Large blocks get a mapping each, there is no region to share
+    alloc_clock += count;
+    if (size >= mmap_threshold) {
+        for (size_t i = 0; i < count; i++) {
+            out[i] = mmap_smalloc(size);
+            if (out[i] == nullptr) {
+                locked_sfree_batch(out, i);
+                return 0;
+            }
+        }
+        return count;
+    }
+
+    // The whole batch is laid out as one region of consecutive blocks
+    if (count > (MAX_SIZE + MD_SIZE) / (size + MD_SIZE))
+        return 0;
+    size_t total = count * (size + MD_SIZE) - MD_SIZE;
+    MetaData* region = nullptr;
+
+    // A batch larger than a segment is allocated block by block
+    if (heap_backend == HEAP_SEGMENTS && total > SEGMENT_SIZE - sizeof(Segment) - MD_SIZE) {
+        for (size_t i = 0; i < count; i++) {
+            out[i] = locked_smalloc(size);
+            if (out[i] == nullptr) {
+                locked_sfree_batch(out, i);
+                return 0;
+            }
+        }
+        return count;
+    }
+
+    if (memory_list || stats.segments) {
+        // Check if histogram has a free block that holds the whole batch
+        region = histFind(total);
+        if (region != nullptr) {
+            histRemove(region);
+        }
+        else {
+            // Check if wilderness chunck is free and enlarge it once
+            MetaData* wild = wilderness();
+            if (wild != nullptr && wild->is_free) {
+                histRemove(wild);
+                if (growTail(total - wild->size)) { // alignment is preserved
+                    region = wild;
+                } else {
+                    histInsert(wild);
+                }
+            }
+        }
+    }
+
+    // If not enough free space was found, extend the heap once for all blocks
+    if (region == nullptr) {
+        region = newBlock(total);
+        if (region == nullptr)
+            return 0;
+    }
+
+    carve(region, size, count, out);
+    return count;
+}
+
+void freeBatchPart(void** ptrs, size_t count) {
+    // 'ptrs' is a scratch copy, it is sorted and its entries cleared as they are done.
+    // Unmap large blocks right away and mark heap blocks as pending,
+    // a pending block is free but not yet in the histogram (next_free points to itself)
+    for (size_t i = 0; i < count; i++) {
+        if (!ptrs[i]) continue;
+
+        MetaData* md = blockOf(ptrs[i]);
+        if (md == nullptr) {
+            stats.invalid_frees++;
+            ptrs[i] = nullptr;
+        }
+        else if (md->is_free || md->is_deferred) {
+            ptrs[i] = nullptr;
+        }
+        else if (!md->is_mmap) {
+            md->is_free = true;
+            md->next_free = md;
+            md->prev_free = nullptr;
+        }
+        else {
+            mmap_sfree(md);
+            ptrs[i] = nullptr;
+        }
+    }
+
+    // Coalesce in a single pass over the pointers sorted by address,
+    // each run of adjacent free blocks is merged and inserted to the histogram once
+    qsort(ptrs, count, sizeof(void*), compareAddress);
+    size_t run_end = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!ptrs[i] || (size_t)ptrs[i] < run_end) continue;
+
+        MetaData* start = (MetaData*)ptrs[i] - 1;
+
+        // Pending blocks before this one were already merged forward,
+        // so a free previous block can only come from the histogram
+        MetaData* prev_block = prevBlock(start);
+        if (prev_block != nullptr && prev_block->is_free) {
+            start = prev_block;
+            histRemove(start);
+        }
+
+        // Swallow every free block that follows
+        MetaData* next_block = nextBlock(start);
+        while (next_block != nullptr && next_block->is_free) {
+            if (next_block->next_free != next_block) {
+                histRemove(next_block);
+            }
+            absorbNext(start);
+            next_block = nextBlock(start);
+        }
+
+        histInsert(start);
+        run_end = (size_t)(start + 1) + start->size;
+        releaseSegment(start);
+    }
+}
+
+void locked_sfree_batch(void** ptrs, size_t count) {
+    if (!ptrs) return;
+
+#ifdef SMALLOC_DEBUG
+    for (size_t i = 0; i < count; i++) {
+        locked_sfree(ptrs[i]);
+    }
+    return;
+#endif
+
+    // The caller's array is left as it is, a copy of up to BATCH_SORT_MAX pointers
+    // at a time is sorted and freed
+    void* sorted[BATCH_SORT_MAX];
+    for (size_t done = 0; done < count; done += BATCH_SORT_MAX) {
+        size_t n = count - done < BATCH_SORT_MAX ? count - done : BATCH_SORT_MAX;
+        memcpy(sorted, ptrs + done, n * sizeof(void*));
+        freeBatchPart(sorted, n);
+    }
+}
+
+void sfree_batch(void** ptrs, size_t count) {
+    HeapLock lock;
+    if (!lock.held) return;
+
+    locked_sfree_batch(ptrs, count);
+}
+
+/* ================= Region Functions ================== */
+
+// Regions hand out memory by bumping a pointer inside chunks taken from the heap,
+// objects have no MetaData of their own and are only released all together
+
+SRegion* sregion_create(size_t chunk_size) {
+    HeapLock lock;
+    if (!lock.held) return nullptr;
+
+    if (chunk_size == 0) chunk_size = REGION_CHUNK;
+    align_memory(&chunk_size);
+    if (chunk_size <= sizeof(RegionChunk) || chunk_size > MAX_SIZE)
+        return nullptr;
+
+    SRegion* region = (SRegion*)locked_smalloc(sizeof(SRegion));
+    if (!region) return nullptr;
+
+    region->first = region->current = region->last = nullptr;
+    region->chunk_size = chunk_size;
+
+    // Add the region to region list
+    region->prev = nullptr;
+    region->next = region_list;
+    if (region_list != nullptr) {
+        region_list->prev = region;
+    }
+    region_list = region;
+    return region;
+}
+
+void* sregion_alloc(SRegion* region, size_t size) {
+    HeapLock lock;
+    if (!lock.held) return nullptr;
+
+    // Update size for memory alignment
+    align_memory(&size);
+
+    if (!region || size <= MIN_SIZE || size > MAX_SIZE)
+        return nullptr;
+
+    // Look for room in the current chunk, or in chunks kept by a reset
+    RegionChunk* chunk = region->current;
+    while (chunk != nullptr && chunk->capacity - chunk->used < size) {
+        chunk = chunk->next;
+    }
+
+    // If no chunk has room, take a new one from the heap
+    if (chunk == nullptr) {
+        size_t capacity = region->chunk_size - sizeof(RegionChunk);
+        if (capacity < size) capacity = size;
+
+        chunk = (RegionChunk*)locked_smalloc(sizeof(RegionChunk) + capacity);
+        if (!chunk) return nullptr;
+
+        chunk->next = nullptr;
+        chunk->used = 0;
+        chunk->capacity = capacity;
+        if (region->last != nullptr) {
+            region->last->next = chunk;
+        } else {
+            region->first = chunk;
+        }
+        region->last = chunk;
+    }
+
+    region->current = chunk;
+    void* addr = (char*)(chunk + 1) + chunk->used;
+    chunk->used += size;
+    return addr;
+}
+
+void locked_sregion_reset(SRegion* region, bool keep_chunks) {
+    if (!region) return;
+
+    // Either rewind every chunk, or give them all back to the histogram
+    RegionChunk* chunk = region->first;
+    while (chunk != nullptr) {
+        RegionChunk* next = chunk->next;
+        if (keep_chunks) {
+            chunk->used = 0;
+        } else {
+            locked_sfree(chunk);
+        }
+        chunk = next;
+    }
+
+    if (!keep_chunks) {
+        region->first = region->last = nullptr;
+    }
+    region->current = region->first;
+}
+
+void sregion_reset(SRegion* region, bool keep_chunks) {
+    HeapLock lock;
+    if (!lock.held) return;
+
+    locked_sregion_reset(region, keep_chunks);
+}
+
+void sregion_destroy(SRegion* region) {
+    HeapLock lock;
+    if (!lock.held) return;
+
+    if (!region) return;
+
+    locked_sregion_reset(region, false);
+
+    // Remove the region from region list
+    if (region->next != nullptr) {
+        region->next->prev = region->prev;
+    }
+    if (region->prev != nullptr) {
+        region->prev->next = region->next;
+    } else {
+        region_list = region->next;
+    }
+    locked_sfree(region);
+}
+
+/* =============== Maintenance Functions =============== */
+
+MetaData* treeLast(MetaData* md) {
+    while (md != nullptr && node(md)->right != nullptr) {
+        md = node(md)->right;
+    }
+    return md;
+}
+
+MetaData* treePrev(MetaData* md) {
+    // The next smaller block in (size, address) order
+    if (node(md)->left != nullptr) return treeLast(node(md)->left);
+    MetaData* parent = node(md)->parent;
+    while (parent != nullptr && node(parent)->left == md) {
+        md = parent;
+        parent = node(md)->parent;
+    }
+    return parent;
+}
+
+void trimWilderness(size_t pad, size_t min_release) {
+    // Give the top of a free wilderness back, keeping 'pad' bytes of it for the next growth
+    MetaData* md = wilderness();
+    if (md == nullptr || !md->is_free || persist != nullptr || heapSbrk(0) != blockEnd(md))
+        return;
+
+    size_t page = getpagesize();
+    char* keep = (char*)(((size_t)(md + 1) + pad + page - 1) / page * page);
+    if (blockEnd(md) <= keep || (size_t)(blockEnd(md) - keep) < min_release) return;
+
+    size_t release = blockEnd(md) - keep;
+    histRemove(md);
+    if (sbrk(-(intptr_t)release) != (void*)(-1)) {
+        pagemapSet(keep, release, nullptr, PAGE_NONE);
+        md->size -= release;
+        stats.heap_bytes -= release;
+        stats.trimmed_bytes += release;
+    }
+    histInsert(md);
+}
+
+bool decayed(MetaData* md) {
+    // Free for MAINTENANCE_DECAY_MS, counted in rounds of the current interval
+    size_t rounds = maintenance_interval > 0 ? MAINTENANCE_DECAY_MS / maintenance_interval : 0;
+    return maintenance_round - md->birth > (rounds > 1 ? rounds : 1);
+}
+
+bool purgeFree(size_t budget, bool decayed_only) {
+    // The biggest free blocks come first. With 'decayed_only' a block is only purged
+    // once it decayed. A purged block is skipped until it is reused or merged, so only
+    // the purges count towards MAINTENANCE_PURGE_BLOCKS. Returns true when the budget
+    // or the block count ran out, the next call goes on from where this one stopped
+    size_t purged = 0;
+    for (size_t i = 0; i < MAX_NODES; i++) {
+        for (MetaData* md = treeLast(arenas[i].tree_root); md != nullptr && md->size >= PURGE_MIN;
+                md = treePrev(md)) {
+            if (md->is_purged || (decayed_only && !decayed(md)) || md == wilderness())
+                continue;
+            if (purged++ == MAINTENANCE_PURGE_BLOCKS) return true;
+
+            // The tree node and the boundary tag stay, the rest reads back as zeros
+            purgePages((char*)(md + 1) + sizeof(TreeNode), blockEnd(md) - sizeof(size_t));
+            md->is_purged = true;
+            if (md->size >= budget) return true;
+            budget -= md->size;
+        }
+    }
+    return false;
+}
+
+bool maintenanceStep() {
+    // One bounded round of housekeeping under the heap lock, true if work is left
+    stats.maintenance_steps++;
+    for (size_t i = 0; i < MAX_NODES; i++) {
+        if (arenas[i].deferred_count >= DEFER_BLOCKS / 2) deferredFlush(&arenas[i]);
+    }
+    MetaData* top = wilderness();
+    if (top != nullptr && top->is_free && decayed(top)) trimWilderness(TRIM_PAD, TRIM_MIN);
+    return purgeFree(MAINTENANCE_PURGE_MAX, true);
+}
+
+bool maintenanceOwner() {
+    // A thread that was stopped and replaced before it saw the stop just leaves
+    return maintenance_running && pthread_equal(maintenance_thread, pthread_self());
+}
+
+void pressureTick();
+
+void* maintenanceMain(void*) {
+    heapLock();
+    while (maintenanceOwner()) {
+        if (!maintenance_wanted) {
+            timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += maintenance_interval / 1000;
+            deadline.tv_nsec += maintenance_interval % 1000 * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&maintenance_cond, &heap_mutex, &deadline);
+            if (!maintenanceOwner()) break;
+            maintenance_round++;
+            pressureTick();
+            if (!maintenanceOwner()) break;
+        }
+        arena = threadArena();
+        maintenance_wanted = maintenanceStep();
+
+        // Let the waiting requests in before the next step
+        if (maintenance_wanted) {
+            heapUnlock();
+            sched_yield();
+            heapLock();
+        }
+    }
+    heapUnlock();
+    return nullptr;
+}
+
+int smalloc_maintenance_start(size_t interval_ms) {
+    HeapLock lock;
+    if (!lock.held || interval_ms == 0) return 0;
+
+    // A running thread only takes the new interval
+    maintenance_interval = interval_ms;
+    if (maintenance_running) return 1;
+
+    // The thread blocks every signal, so no handler can run on it while it holds the lock
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    maintenance_running = true;
+    if (pthread_create(&maintenance_thread, nullptr, maintenanceMain, nullptr) != 0) {
+        maintenance_running = false;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    return maintenance_running;
+}
+
+int smalloc_maintenance_stop() {
+    pthread_t thread;
+    {
+        HeapLock lock;
+        if (!lock.held || !maintenance_running) return 0;
+        maintenance_running = false;
+        thread = maintenance_thread;
+        pthread_cond_signal(&maintenance_cond);
+    }
+    pthread_join(thread, nullptr);
+    return 1;
+}
+
+/* ================= Pressure Functions ================ */
+
+struct PressureSample {
+    size_t current;
+    size_t limit;   // 0 when the cgroup has none, or the files can't be read
+    size_t psi;
+};
+
+bool readPressureFile(const char* root, const char* name, char* buffer, size_t size) {
+    // Plain open and read, the monitor can't allocate
+    char path[PRESSURE_ROOT_MAX + 64];
+    snprintf(path, sizeof(path), "%s%s", root, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ssize_t length = read(fd, buffer, size - 1);
+    close(fd);
+    if (length <= 0) return false;
+    buffer[length] = '\0';
+    return true;
+}
+
+PressureSample pressureSample(const char* root) {
+    // 'root' is a copy of pressure_root taken under the heap lock, the files are
+    // read without it
+    PressureSample sample = {0, 0, 0};
+    char buffer[256];
+
+    // memory.max is "max" when the cgroup has no limit
+    if (readPressureFile(root, "/sys/fs/cgroup/memory.max", buffer, sizeof(buffer)) &&
+            buffer[0] >= '0' && buffer[0] <= '9') {
+        size_t limit = strtoull(buffer, nullptr, 10);
+        if (readPressureFile(root, "/sys/fs/cgroup/memory.current", buffer, sizeof(buffer))) {
+            sample.current = strtoull(buffer, nullptr, 10);
+            sample.limit = limit;
+        }
+    }
+
+    // "some avg10=12.34 avg60=..." always has two decimals
+    if (readPressureFile(root, "/proc/pressure/memory", buffer, sizeof(buffer))) {
+        char* avg = strstr(buffer, "some avg10=");
+        if (avg != nullptr) {
+            char* end;
+            sample.psi = strtoul(avg + strlen("some avg10="), &end, 10) * 100;
+            if (end[0] == '.' && end[1] >= '0' && end[1] <= '9' && end[2] >= '0' && end[2] <= '9')
+                sample.psi += (end[1] - '0') * 10 + (end[2] - '0');
+        }
+    }
+    return sample;
+}
+
+bool pressureHigh(PressureSample sample, bool relaxing) {
+    // Leaving takes lower levels than entering, so the heap doesn't flap around them
+    size_t usage = pressure_usage;
+    size_t psi = pressure_psi;
+    if (relaxing) {
+        if (usage != 0) usage = usage > PRESSURE_RELAX ? usage - PRESSURE_RELAX : 1;
+        psi = (psi + 1) / 2;
+    }
+    if (usage != 0 && sample.limit != 0 && sample.current * 100 >= sample.limit * usage)
+        return true;
+    return psi != 0 && sample.psi >= psi;
+}
+
+bool pressureApply(PressureSample sample) {
+    // Under the heap lock, true while the heap is under pressure
+    if (!under_pressure && !pressureHigh(sample, false)) return false;
+    if (under_pressure && !pressureHigh(sample, true)) {
+        under_pressure = false;
+        if (!mmap_threshold_fixed && mmap_threshold < pressure_threshold) {
+            setMmapThreshold(pressure_threshold);
+        }
+        return false;
+    }
+    if (!under_pressure) {
+        under_pressure = true;
+        pressure_threshold = mmap_threshold;
+        stats.pressure_events++;
+    }
+
+    // Every check under pressure gives back what was freed since the last one,
+    // and asks the caches built on top of the heap to do the same
+    deferredFlushAll();
+    trimWilderness(SPLIT_MIN, getpagesize());
+    while (purgeFree(SIZE_MAX, false)) {
+    }
+    lowerMmapThreshold();
+    sbrk_chunk = sbrk_chunk_min;
+    runCacheHooks(SMALLOC_EVENT_PRESSURE);
+    return true;
+}
+
+void pressureTick() {
+    // From the maintenance thread, which holds the heap lock. The files are read
+    // without it, so the requests go on meanwhile
+    if (pressure_usage == 0 && pressure_psi == 0) return;
+    char root[PRESSURE_ROOT_MAX];
+    strcpy(root, pressure_root);
+    heapUnlock();
+    PressureSample sample = pressureSample(root);
+    heapLock();
+    if (maintenanceOwner()) {
+        arena = threadArena();
+        pressureApply(sample);
+    }
+}
+
+int smalloc_pressure_root(const char* root) {
+    // Not while the maintenance thread checks, null goes back to the real ones
+    HeapLock lock;
+    if (!lock.held || maintenance_running) return 0;
+    if (root == nullptr) root = "";
+    if (strlen(root) >= PRESSURE_ROOT_MAX) return 0;
+    strcpy(pressure_root, root);
+    return 1;
+}
+
+int smalloc_pressure_check() {
+    char root[PRESSURE_ROOT_MAX];
+    {
+        HeapLock lock;
+        if (!lock.held) return 0;
+        strcpy(root, pressure_root);
+    }
+    PressureSample sample = pressureSample(root);
+    HeapLock lock;
+    if (!lock.held) return 0;
+    return pressureApply(sample);
+}
+
+int smalloc_cache_hook(void (*hook)(int event)) {
+    HeapLock lock;
+    if (!lock.held || hook == nullptr) return 0;
+    for (size_t i = 0; i < cache_hook_count; i++) {
+        if (cache_hooks[i] == hook) return 1;
+    }
+    if (cache_hook_count == CACHE_HOOKS_MAX) return 0;
+    cache_hooks[cache_hook_count++] = hook;
+    return 1;
+}
+
+/* ================ Persistent Functions =============== */
+
+// spersist_open must come before any other allocation: the file heap takes the place
+// of the sbrk heap, and every block comes from it (the mmap threshold is off).
+// The file is mapped at its base and locked, so only one process uses it.
+// spersist_close saves the heap and marks the file clean, a file that was not
+// closed (a crash) is refused, its header may not match its blocks.
+
+void persistSave(PersistHeader* header) {
+    header->memory_list = memory_list;
+    header->heap_tail = heap_tail;
+    header->exact_break = exact_break;
+    header->free_blocks = stats.free_blocks;
+    header->free_bytes = stats.free_bytes;
+    header->heap_blocks = stats.heap_blocks;
+    header->heap_bytes = stats.heap_bytes;
+    header->deferred_blocks = stats.deferred_blocks;
+    header->deferred_bytes = stats.deferred_bytes;
+    header->arena = arenas[0];
+    header->region_list = region_list;
+}
+
+void persistLoad(PersistHeader* header) {
+    memory_list = header->memory_list;
+    heap_tail = header->heap_tail;
+    exact_break = header->exact_break;
+    stats.free_blocks = header->free_blocks;
+    stats.free_bytes = header->free_bytes;
+    stats.heap_blocks = header->heap_blocks;
+    stats.heap_bytes = header->heap_bytes;
+    stats.deferred_blocks = header->deferred_blocks;
+    stats.deferred_bytes = header->deferred_bytes;
+    arenas[0] = header->arena;
+    region_list = header->region_list;
+}
+
+int spersist_open(const char* path, size_t capacity) {
+    HeapLock lock;
+    if (!lock.held) return -1;
+
+    if (persist != nullptr || heap_backend != HEAP_SBRK || memory_list != nullptr ||
+            mmap_list != nullptr || path == nullptr)
+        return -1;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) return -1;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // An existing file brings its own base and size, a new one gets the defaults
+    PersistHeader saved;
+    ssize_t length = pread(fd, &saved, sizeof(saved), 0);
+    bool reopen = length > 0;
+    size_t page = getpagesize();
+    size_t header_size = (sizeof(PersistHeader) + page - 1) / page * page;
+    char* base = PERSIST_BASE;
+    if (reopen) {
+        if (length != sizeof(saved) || saved.magic != PERSIST_MAGIC ||
+                saved.meta_size != MD_SIZE || !saved.clean) {
+            close(fd);
+            return -1;
+        }
+        base = saved.base;
+        capacity = saved.capacity;
+    } else {
+        capacity = (capacity + page - 1) / page * page;
+        if (capacity <= header_size || ftruncate(fd, capacity) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    void* mapped = mmap(base, capacity, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if (mapped != base) {
+        if (mapped != MAP_FAILED) munmap(mapped, capacity);
+        close(fd);
+        return -1;
+    }
+
+    // The heap pages of a reopened file are ours again
+    PersistHeader* header = (PersistHeader*)base;
+    if (reopen && !pagemapSet(base + header_size, header->brk - (base + header_size),
+                                &arenas[0], PAGE_HEAP)) {
+        munmap(base, capacity);
+        close(fd);
+        return -1;
+    }
+    if (reopen) {
+        persistLoad(header);
+        for (MetaData* md = memory_list; md != nullptr; md = nextBlock(md)) {
+            markStart(md);
+        }
+    } else {
+        memset(header, 0, sizeof(PersistHeader));
+        header->magic = PERSIST_MAGIC;
+        header->meta_size = MD_SIZE;
+        header->base = base;
+        header->capacity = capacity;
+        header->brk = base + header_size;
+    }
+    // From here until spersist_close the header lags the heap
+    header->clean = false;
+    msync(header, header_size, MS_SYNC);
+
+    persist = header;
+    persist_fd = fd;
+    mmap_threshold_fixed = true;
+    setMmapThreshold(MAX_SIZE + 8);
+    return reopen ? 1 : 0;
+}
+
+int spersist_close() {
+    HeapLock lock;
+    if (!lock.held) return -1;
+
+    if (persist == nullptr) return -1;
+
+#ifdef SMALLOC_DEBUG
+    // Quarantined blocks go back to the heap before it is saved
+    quarantineFlush();
+#endif
+
+    // A fork child only has a private copy, there is no file to save to
+    PersistHeader* header = persist;
+    bool saved = persist_fd >= 0;
+    if (saved) {
+        persistSave(header);
+        header->clean = true;
+        msync(header, header->brk - header->base, MS_SYNC);
+        close(persist_fd);
+    }
+    clearStarts((char*)header, header->brk);
+    pagemapSet(header, header->capacity, nullptr, PAGE_NONE);
+    munmap(header, header->capacity);
+    persist = nullptr;
+    persist_fd = -1;
+
+    // The caches above the heap still list blocks of the file: they drop them
+    persist_generation.fetch_add(1, std::memory_order_relaxed);
+    runCacheHooks(SMALLOC_EVENT_PERSIST_CLOSE);
+
+    // The process is left with an empty sbrk heap
+    memory_list = heap_tail = nullptr;
+    exact_break = 0;
+    arenas[0] = Arena();
+    region_list = nullptr;
+    stats.free_blocks = stats.free_bytes = stats.heap_blocks = stats.heap_bytes = 0;
+    stats.deferred_blocks = stats.deferred_bytes = 0;
+    mmap_threshold_fixed = false;
+    setMmapThreshold(LARGE_ALLOC);
+    return saved ? 0 : -1;
+}
+
+void spersist_set_root(void* p) {
+    HeapLock lock;
+    if (!lock.held) return;
+
+    if (persist != nullptr) persist->root = p;
+}
+
+size_t spersist_generation() {
+    return persist_generation.load(std::memory_order_relaxed);
+}
+
+void* spersist_get_root() {
+    HeapLock lock;
+    if (!lock.held) return nullptr;
+
+    return persist != nullptr ? persist->root : nullptr;
+}
+
+size_t _num_free_blocks() {
+    return stats.free_blocks + stats.deferred_blocks;
+}
+
+size_t _num_free_bytes() {
+    return stats.free_bytes + stats.deferred_bytes;
+}
+
+size_t _num_allocated_blocks() {
+    return stats.heap_blocks + stats.mmap_blocks;
+}
+
+size_t _num_allocated_bytes() {
+    return stats.heap_bytes + stats.mmap_bytes;
+}
+
+size_t _size_meta_data() {
+    return sizeof(MetaData);
+}
+
+size_t _num_meta_data_bytes() {
+    return _num_allocated_blocks() * _size_meta_data();
+}
+
+size_t _num_region_chunks() {
+    HeapLock lock;
+    if (!lock.held) return 0;
+
+    size_t chunks = 0;
+    for (SRegion* region = region_list; region != nullptr; region = region->next) {
+        for (RegionChunk* chunk = region->first; chunk != nullptr; chunk = chunk->next) {
+            chunks++;
+        }
+    }
+    return chunks;
+}
+
+size_t _num_region_bytes() {
+    HeapLock lock;
+    if (!lock.held) return 0;
+
+    size_t used_bytes = 0;
+    for (SRegion* region = region_list; region != nullptr; region = region->next) {
+        for (RegionChunk* chunk = region->first; chunk != nullptr; chunk = chunk->next) {
+            used_bytes += chunk->used;
+        }
+    }
+    return used_bytes;
+}
+
+size_t _num_sbrk_calls() {
+    return stats.sbrk_calls;
+}
+
+size_t _num_sbrk_calls_saved() {
+    return stats.sbrk_calls_saved;
+}
+
+size_t _num_heap_segments() {
+    return stats.segments;
+}
+
+size_t _mmap_threshold() {
+    return mmap_threshold;
+}
+
+size_t _num_mmap_threshold_changes() {
+    return stats.mmap_threshold_changes;
+}
+
+size_t _num_realloc_copied_bytes() {
+    return stats.realloc_copied_bytes;
+}
+
+size_t _num_purged_bytes() {
+    return stats.purged_bytes;
+}
+
+size_t _num_maintenance_steps() {
+    return stats.maintenance_steps;
+}
+
+size_t _num_trimmed_bytes() {
+    return stats.trimmed_bytes;
+}
+
+size_t _num_pressure_events() {
+    return stats.pressure_events;
+}
+
+size_t _num_invalid_frees() {
+    return stats.invalid_frees;
+}
+
+size_t _num_pagemap_bytes() {
+    return stats.pagemap_leaves * (sizeof(size_t) << PAGEMAP_LEAF_BITS) +
+            stats.startmap_leaves * sizeof(uint64_t) * STARTMAP_LEAF_WORDS;
+}
+
+size_t _num_numa_nodes() {
+    HeapLock lock;
+    if (!lock.held) return 0;
+
+    if (heap_backend == HEAP_SEGMENTS && numa_nodes == 0) detectNodes();
+    return heap_backend == HEAP_SEGMENTS ? numa_nodes : 1;
+}
+
+size_t _num_node_segments(int node) {
+    HeapLock lock;
+    if (!lock.held || node < 0 || node >= MAX_NODES) return 0;
+
+    size_t segments = 0;
+    for (Segment* segment = arenas[node].segment_list; segment != nullptr; segment = segment->next) {
+        segments++;
+    }
+    return segments;
+}
+
+size_t nodeBytes(int node, bool only_free) {
+    // The sbrk heap is all on node 0, segments are walked block by block
+    if (heap_backend != HEAP_SEGMENTS) {
+        if (node != 0) return 0;
+        return only_free ? stats.free_bytes + stats.deferred_bytes : stats.heap_bytes;
+    }
+
+    size_t bytes = 0;
+    for (Segment* segment = arenas[node].segment_list; segment != nullptr; segment = segment->next) {
+        for (MetaData* md = segment->first; md != nullptr; md = nextBlock(md)) {
+            if (!only_free || md->is_free || md->is_deferred) bytes += md->size;
+        }
+    }
+    return bytes;
+}
+
+size_t _num_node_bytes(int node) {
+    HeapLock lock;
+    if (!lock.held || node < 0 || node >= MAX_NODES) return 0;
+
+    return nodeBytes(node, false);
+}
+
+size_t _num_node_free_bytes(int node) {
+    HeapLock lock;
+    if (!lock.held || node < 0 || node >= MAX_NODES) return 0;
+
+    return nodeBytes(node, true);
 }
@@ -0,0 +1,522 @@
+#ifndef MALLOC_CORE_H
+#define MALLOC_CORE_H
+
+#include <unistd.h>
+#include <cstring>
+#include <pthread.h>
+#include <sys/mman.h>
+
+// SmallocCore<Fit, Split, Merge, Alignment, Large, Lock> is the sbrk heap of malloc_2
+// and malloc_3, with the ways they differ pulled out into policies:
+//   Fit:       FirstFit / BestFit walk the block list, SegregatedFit keeps the free
+//              blocks in 128 size sorted lists of 1KB ranges
+//   Split:     NoSplit, or SplitAbove<N> cuts a free block of N bytes and up off the
+//              end of a block that is bigger than the request
+//   Merge:     NoMerge, or MergeNeighbours coalesces a freed block with its free
+//              neighbours, grows a free wilderness instead of adding a block, and
+//              lets srealloc grow a block into its neighbours
+//   Alignment: Align<A> rounds the requested sizes up to a multiple of A
+//   Large:     NoLarge, or MmapAbove<N> maps blocks of N bytes and up on their own
+//   Lock:      NoLock, or MutexLock around every call
+// Every choice is a constant of its policy that the core tests with if constexpr, so
+// an alias compiles to the code of the file it replaced. Each instance has its own
+// lists, and blocks are only neighbours if they touch, so any number of combinations
+// can share the break in one process.
+// malloc_4.cpp is not built on the core: its size tree, arenas, segments, deferred
+// frees, page map and persistent heap have no policy here, it keeps its own heap.
+
+#define CORE_MIN_SIZE 0
+#define CORE_MAX_SIZE 100000000
+#define CORE_BUCKETS 128
+
+/* ===================== Fit Policies ================== */
+
+struct FirstFit {
+    template <class Block> struct Links {};
+
+    template <class Block> struct Index {
+        Block* find(Block* blocks, size_t size) {
+            for (Block* md = blocks; md != nullptr; md = md->next) {
+                if (md->is_free && md->size >= size) return md;
+            }
+            return nullptr;
+        }
+        void insert(Block*) {}
+        void remove(Block*) {}
+    };
+};
+
+struct BestFit {
+    template <class Block> struct Links {};
+
+    template <class Block> struct Index {
+        Block* find(Block* blocks, size_t size) {
+            // The smallest free block that fits, the first one among equal sizes
+            Block* best = nullptr;
+            for (Block* md = blocks; md != nullptr; md = md->next) {
+                if (md->is_free && md->size >= size && (best == nullptr || md->size < best->size)) {
+                    best = md;
+                }
+            }
+            return best;
+        }
+        void insert(Block*) {}
+        void remove(Block*) {}
+    };
+};
+
+struct SegregatedFit {
+    template <class Block> struct Links {
+        Block* next_free;
+        Block* prev_free;
+    };
+
+    template <class Block> struct Index {
+        Block* histogram[CORE_BUCKETS];
+
+        static int histIndex(size_t size) {
+            return size / 1024 < CORE_BUCKETS ? size / 1024 : CORE_BUCKETS - 1;
+        }
+
+        Block* find(Block*, size_t size) {
+            // The lists are sorted, the first block that fits is the best fit
+            for (int i = histIndex(size); i < CORE_BUCKETS; i++) {
+                for (Block* md = histogram[i]; md != nullptr; md = md->next_free) {
+                    if (md->size >= size) return md;
+                }
+            }
+            return nullptr;
+        }
+
+        void insert(Block* md) {
+            // Before the first block of the same size or bigger
+            Block** link = &histogram[histIndex(md->size)];
+            Block* prev = nullptr;
+            while (*link != nullptr && (*link)->size < md->size) {
+                prev = *link;
+                link = &(*link)->next_free;
+            }
+            md->next_free = *link;
+            md->prev_free = prev;
+            if (*link != nullptr) {
+                (*link)->prev_free = md;
+            }
+            *link = md;
+        }
+
+        void remove(Block* md) {
+            if (md->prev_free != nullptr) {
+                md->prev_free->next_free = md->next_free;
+            } else {
+                histogram[histIndex(md->size)] = md->next_free;
+            }
+            if (md->next_free != nullptr) {
+                md->next_free->prev_free = md->prev_free;
+            }
+            md->next_free = md->prev_free = nullptr;
+        }
+    };
+};
+
+/* ==================== Other Policies ================= */
+
+struct NoSplit {
+    static constexpr bool splits(size_t, size_t) { return false; }
+};
+
+template <size_t N>
+struct SplitAbove {
+    // 'spare' bytes past the request, the cut off block needs a header of its own
+    static constexpr bool splits(size_t spare, size_t header) { return spare >= N + header; }
+};
+
+struct NoMerge {
+    static constexpr bool merges = false;
+};
+
+struct MergeNeighbours {
+    static constexpr bool merges = true;
+};
+
+template <size_t A>
+struct Align {
+    static constexpr size_t apply(size_t size) { return (size + A - 1) / A * A; }
+};
+
+struct NoLarge {
+    static constexpr bool maps(size_t) { return false; }
+};
+
+template <size_t N>
+struct MmapAbove {
+    static constexpr bool maps(size_t size) { return size >= N; }
+};
+
+struct NoLock {
+    void lock() {}
+    void unlock() {}
+};
+
+struct MutexLock {
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    void lock() { pthread_mutex_lock(&mutex); }
+    void unlock() { pthread_mutex_unlock(&mutex); }
+};
+
+/* ======================== Core ======================= */
+
+// The header in front of every block. The free list links come first, when the fit
+// policy has any, so the header is as small as the one of the file it replaced
+template <class Fit>
+struct CoreBlock : Fit::template Links<CoreBlock<Fit>> {
+    size_t size;
+    bool is_free;
+    bool is_mmap;
+    CoreBlock* next;
+    CoreBlock* prev;
+};
+
+template <class Fit, class Split, class Merge, class Alignment, class Large, class Lock>
+class SmallocCore {
+public:
+    typedef CoreBlock<Fit> Block;
+
+    void* smalloc(size_t size) {
+        Guard guard(lock);
+        return allocate(size);
+    }
+
+    void* scalloc(size_t num, size_t size) {
+        // First, allocate memory using smalloc, then reset the block
+        if (size != 0 && num > CORE_MAX_SIZE / size) return nullptr;
+        Guard guard(lock);
+        void* p = allocate(num * size);
+        return p != nullptr ? memset(p, 0, num * size) : nullptr;
+    }
+
+    void sfree(void* p) {
+        Guard guard(lock);
+        release(p);
+    }
+
+    void* srealloc(void* oldp, size_t size) {
+        Guard guard(lock);
+        return resize(oldp, size);
+    }
+
+    size_t _num_free_blocks() {
+        Guard guard(lock);
+        size_t count = 0;
+        for (Block* md = blocks; md != nullptr; md = md->next) {
+            count += md->is_free;
+        }
+        return count;
+    }
+
+    size_t _num_free_bytes() {
+        Guard guard(lock);
+        size_t bytes = 0;
+        for (Block* md = blocks; md != nullptr; md = md->next) {
+            if (md->is_free) bytes += md->size;
+        }
+        return bytes;
+    }
+
+    size_t _num_allocated_blocks() {
+        Guard guard(lock);
+        size_t count = 0;
+        for (Block* md = blocks; md != nullptr; md = md->next) count++;
+        for (Block* md = mapped; md != nullptr; md = md->next) count++;
+        return count;
+    }
+
+    size_t _num_allocated_bytes() {
+        Guard guard(lock);
+        size_t bytes = 0;
+        for (Block* md = blocks; md != nullptr; md = md->next) bytes += md->size;
+        for (Block* md = mapped; md != nullptr; md = md->next) bytes += md->size;
+        return bytes;
+    }
+
+    size_t _num_meta_data_bytes() {
+        return _num_allocated_blocks() * _size_meta_data();
+    }
+
+    static constexpr size_t _size_meta_data() {
+        return sizeof(Block);
+    }
+
+private:
+    struct Guard {
+        Lock& held;
+        explicit Guard(Lock& lock) : held(lock) { held.lock(); }
+        ~Guard() { held.unlock(); }
+    };
+
+    Block* blocks = nullptr;  // the heap blocks in the order they were added
+    Block* tail = nullptr;
+    Block* mapped = nullptr;
+    typename Fit::template Index<Block> index = {};
+    Lock lock;
+
+    /* ================= Helper Functions ================== */
+
+    static bool touches(Block* md, Block* next) {
+        return (char*)(md + 1) + md->size == (char*)next;
+    }
+
+    static bool atBreak(Block* md) {
+        // Nobody else moved the break since md was added or grown
+        return (char*)(md + 1) + md->size == sbrk(0);
+    }
+
+    void absorbNext(Block* md) {
+        // Grow md over the block that follows it in the list
+        Block* next_block = md->next;
+        md->size += next_block->size + sizeof(Block);
+        md->next = next_block->next;
+        if (md->next != nullptr) {
+            md->next->prev = md;
+        }
+        if (tail == next_block) {
+            tail = md;
+        }
+    }
+
+    void split(Block* md, size_t size) {
+        if (!Split::splits(md->size - size, sizeof(Block))) return;
+
+        Block* rest = (Block*)((char*)(md + 1) + size);
+        rest->size = md->size - size - sizeof(Block);
+        rest->is_free = true;
+        rest->is_mmap = false;
+        rest->prev = md;
+        rest->next = md->next;
+        if (rest->next != nullptr) {
+            rest->next->prev = rest;
+        }
+        if (tail == md) {
+            tail = rest;
+        }
+        md->size = size;
+        md->next = rest;
+        index.insert(rest);
+    }
+
+    void merge(Block* md) {
+        // Merge with next block if it's free
+        Block* next_block = md->next;
+        if (next_block != nullptr && next_block->is_free && touches(md, next_block)) {
+            index.remove(md);
+            index.remove(next_block);
+            absorbNext(md);
+            index.insert(md);
+        }
+
+        // Merge with previous block if it's free
+        Block* prev_block = md->prev;
+        if (prev_block != nullptr && prev_block->is_free && touches(prev_block, md)) {
+            index.remove(prev_block);
+            index.remove(md);
+            absorbNext(prev_block);
+            index.insert(prev_block);
+        }
+    }
+
+    Block* newBlock(size_t size) {
+        // Allocate a new block of 'size' bytes at the end of the heap
+        Block* md = (Block*)sbrk(size + sizeof(Block));
+        if (md == (void*)(-1)) return nullptr;
+
+        md->size = size;
+        md->is_free = false;
+        md->is_mmap = false;
+        md->next = nullptr;
+        md->prev = tail;
+        if (tail != nullptr) {
+            tail->next = md;
+        } else {
+            blocks = md;
+        }
+        tail = md;
+        return md;
+    }
+
+    bool growTail(size_t size) {
+        // The last block can grow in place if it ends at the break
+        if (tail == nullptr || !atBreak(tail) || sbrk(size - tail->size) == (void*)(-1))
+            return false;
+        tail->size = size;
+        return true;
+    }
+
+    void* heapAllocate(size_t size) {
+        // First, check if a free block has enough space
+        Block* md = index.find(blocks, size);
+        if (md != nullptr) {
+            index.remove(md);
+            md->is_free = false;
+            split(md, size);
+            return md + 1;
+        }
+
+        // Then, grow a free wilderness, or add a new block
+        if constexpr (Merge::merges) {
+            if (tail != nullptr && tail->is_free && atBreak(tail)) {
+                if (sbrk(size - tail->size) == (void*)(-1)) return nullptr;
+                index.remove(tail);
+                tail->size = size;
+                tail->is_free = false;
+                return tail + 1;
+            }
+        }
+        md = newBlock(size);
+        return md != nullptr ? md + 1 : nullptr;
+    }
+
+    void* mapBlock(size_t size) {
+        // Allocate large memory for meta-data and 'size' bytes using mmap
+        void* mm_block = mmap(NULL, size + sizeof(Block), PROT_READ | PROT_WRITE,
+                                MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (mm_block == MAP_FAILED) return nullptr;
+
+        Block* md = (Block*)mm_block;
+        md->size = size;
+        md->is_free = false;
+        md->is_mmap = true;
+        md->prev = nullptr;
+        md->next = mapped;
+        if (mapped != nullptr) {
+            mapped->prev = md;
+        }
+        mapped = md;
+        return md + 1;
+    }
+
+    void unmapBlock(Block* md) {
+        // Remove block from the mapped list and give its pages back
+        if (md->next != nullptr) {
+            md->next->prev = md->prev;
+        }
+        if (md->prev != nullptr) {
+            md->prev->next = md->next;
+        } else {
+            mapped = md->next;
+        }
+        munmap(md, md->size + sizeof(Block));
+    }
+
+    /* ================ Upgraded Functions ================= */
+
+    void* allocate(size_t size) {
+        if (size <= CORE_MIN_SIZE || size > CORE_MAX_SIZE) return nullptr;
+        size = Alignment::apply(size);
+
+        if (Large::maps(size)) return mapBlock(size);
+        return heapAllocate(size);
+    }
+
+    void release(void* p) {
+        if (!p) return;
+
+        Block* md = (Block*)p - 1;
+        if (md->is_free) return;
+        if (md->is_mmap) {
+            unmapBlock(md);
+            return;
+        }
+
+        // Add the block to the free blocks and merge it with its neighbours
+        md->is_free = true;
+        index.insert(md);
+        if constexpr (Merge::merges) {
+            merge(md);
+        }
+    }
+
+    void* move(void* oldp, size_t size) {
+        // Copy the data to a new block, then free the old one
+        Block* old_md = (Block*)oldp - 1;
+        void* newp = Large::maps(size) ? mapBlock(size) : heapAllocate(size);
+        if (!newp) return nullptr;
+
+        memmove(newp, oldp, old_md->size < size ? old_md->size : size);
+        release(oldp);
+        return newp;
+    }
+
+    void* resize(void* oldp, size_t size) {
+        if (size <= CORE_MIN_SIZE || size > CORE_MAX_SIZE) return nullptr;
+
+        // If oldp is null, allocate memory for 'size' bytes and return a pointer to it
+        if (oldp == nullptr) return allocate(size);
+        size = Alignment::apply(size);
+
+        // Mappings and blocks that become or stop being one always move
+        Block* old_md = (Block*)oldp - 1;
+        if (old_md->is_mmap || Large::maps(size)) return move(oldp, size);
+
+        // Check if old block has enough memory to support the new block size
+        if (old_md->size >= size) {
+            split(old_md, size);
+            return oldp;
+        }
+
+        if constexpr (Merge::merges) {
+            Block* prev_block = old_md->prev;
+            Block* next_block = old_md->next;
+            bool prev_free = prev_block != nullptr && prev_block->is_free && touches(prev_block, old_md);
+            bool next_free = next_block != nullptr && next_block->is_free && touches(old_md, next_block);
+            size_t old_size = old_md->size;
+
+            // Check if merging with PREVIOUS block is sufficient
+            if (prev_free && prev_block->size + old_size + sizeof(Block) >= size) {
+                index.remove(prev_block);
+                prev_block->is_free = false;
+                absorbNext(prev_block);
+                memmove(prev_block + 1, oldp, old_size);
+                split(prev_block, size);
+                return prev_block + 1;
+            }
+
+            // If not, check if merging with NEXT block is sufficient
+            if (next_free && old_size + next_block->size + sizeof(Block) >= size) {
+                index.remove(next_block);
+                absorbNext(old_md);
+                split(old_md, size);
+                return oldp;
+            }
+
+            // If not, check if merging with BOTH adjacent blocks is sufficient
+            if (prev_free && next_free &&
+                    prev_block->size + old_size + next_block->size + 2 * sizeof(Block) >= size) {
+                index.remove(prev_block);
+                index.remove(next_block);
+                prev_block->is_free = false;
+                absorbNext(prev_block);
+                absorbNext(prev_block);
+                memmove(prev_block + 1, oldp, old_size);
+                split(prev_block, size);
+                return prev_block + 1;
+            }
+
+            // If not, check if the block is the wilderness and enlarge it
+            if (old_md == tail && growTail(size)) {
+                return oldp;
+            }
+        }
+        return move(oldp, size);
+    }
+};
+
+/* ====================== Variants ===================== */
+
+// malloc_2.cpp and malloc_3.cpp expose theirs as smalloc & co.
+typedef SmallocCore<FirstFit, NoSplit, NoMerge, Align<1>, NoLarge, NoLock> Malloc2;
+typedef SmallocCore<SegregatedFit, SplitAbove<128>, MergeNeighbours, Align<1>,
+                    MmapAbove<128 * 1024>, NoLock> Malloc3;
+// Malloc3 with 8 byte alignment behind a mutex, to measure what the lock costs
+typedef SmallocCore<SegregatedFit, SplitAbove<128>, MergeNeighbours, Align<8>,
+                    MmapAbove<128 * 1024>, MutexLock> SegregatedLocked;
+
+#endif //MALLOC_CORE_H
@@ -0,0 +1,367 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "os_malloc.h"
+
+#define SPLIT_MIN 128
+#define KB 1024
+#define MD_SIZE sizeof(ShmBlock)
+#define SHM_MAGIC 0x53484D4845415031ULL
+
+using std::memset;
+
+// The heap is one shared mapping that every process may map at another address,
+// so blocks link to each other by offsets from the start of the mapping (0 is none).
+// A robust process-shared mutex guards it: a process that dies holding the lock
+// doesn't block the others, and if it died in the middle of an update the heap is
+// marked broken and refuses every request instead of handing out bad blocks.
+
+struct ShmBlock {
+    size_t size;
+    bool is_free;
+    bool prev_is_free; // the block before is in a free list and has a footer
+    bool is_last;      // no block follows until the heap's break
+    size_t next_free;
+    size_t prev_free;
+};
+
+struct ShmHeap {
+    size_t magic;
+    size_t capacity;   // length of the mapping, the break can't pass it
+    size_t brk;        // offset of the end of the last block
+    size_t tail;       // offset of the last block
+    pthread_mutex_t mutex;
+    bool updating;     // set while the lists change, a dead owner leaves it set
+    bool broken;
+    size_t histogram[128];
+    size_t blocks;
+    size_t bytes;
+    size_t free_blocks;
+    size_t free_bytes;
+};
+
+/* ================= Helper Functions ================== */
+
+static ShmBlock* block(ShmHeap* heap, size_t offset) {
+    return offset == 0 ? nullptr : (ShmBlock*)((char*)heap + offset);
+}
+
+static size_t offsetOf(ShmHeap* heap, ShmBlock* md) {
+    return md == nullptr ? 0 : (char*)md - (char*)heap;
+}
+
+static size_t firstBlock() {
+    // Blocks start after the header, 8 byte aligned
+    return (sizeof(ShmHeap) + 7) & ~(size_t)7;
+}
+
+static ShmBlock* nextBlock(ShmBlock* md) {
+    return md->is_last ? nullptr : (ShmBlock*)((char*)(md + 1) + md->size);
+}
+
+static ShmBlock* prevBlock(ShmBlock* md) {
+    // Only a free previous block can be found, through its footer
+    if (!md->prev_is_free) return nullptr;
+    size_t prev_size = *((size_t*)md - 1);
+    return (ShmBlock*)((char*)md - prev_size - MD_SIZE);
+}
+
+static int histIndex(size_t size) {
+    return size / KB < 127 ? size / KB : 127;
+}
+
+static void align_memory(size_t* size) {
+    *size += ((8 - (*size % 8)) % 8);
+}
+
+static void histRemove(ShmHeap* heap, ShmBlock* md) {
+    ShmBlock* next_block = nextBlock(md);
+    if (next_block != nullptr) {
+        next_block->prev_is_free = false;
+    }
+    heap->free_blocks--;
+    heap->free_bytes -= md->size;
+
+    if (md->prev_free != 0) {
+        block(heap, md->prev_free)->next_free = md->next_free;
+    } else {
+        heap->histogram[histIndex(md->size)] = md->next_free;
+    }
+    if (md->next_free != 0) {
+        block(heap, md->next_free)->prev_free = md->prev_free;
+    }
+    md->next_free = md->prev_free = 0;
+}
+
+static void histInsert(ShmHeap* heap, ShmBlock* md) {
+    // Leave the boundary tag for the next block
+    *(size_t*)((char*)(md + 1) + md->size - sizeof(size_t)) = md->size;
+    ShmBlock* next_block = nextBlock(md);
+    if (next_block != nullptr) {
+        next_block->prev_is_free = true;
+    }
+    heap->free_blocks++;
+    heap->free_bytes += md->size;
+
+    // Each list is sorted by size, so the first block that fits is the best fit
+    size_t* link = &heap->histogram[histIndex(md->size)];
+    size_t prev = 0;
+    while (*link != 0 && block(heap, *link)->size < md->size) {
+        prev = *link;
+        link = &block(heap, *link)->next_free;
+    }
+    md->next_free = *link;
+    md->prev_free = prev;
+    if (*link != 0) {
+        block(heap, *link)->prev_free = offsetOf(heap, md);
+    }
+    *link = offsetOf(heap, md);
+}
+
+static ShmBlock* histFind(ShmHeap* heap, size_t size) {
+    for (int i = histIndex(size); i < 128; i++) {
+        for (ShmBlock* md = block(heap, heap->histogram[i]); md != nullptr;
+                md = block(heap, md->next_free)) {
+            if (md->size >= size) {
+                return md;
+            }
+        }
+    }
+    return nullptr;
+}
+
+static void split(ShmHeap* heap, ShmBlock* md, size_t size) {
+    if (md->size - size < SPLIT_MIN + MD_SIZE) {
+        return;
+    }
+
+    ShmBlock* tail = (ShmBlock*)((char*)(md + 1) + size);
+    tail->size = md->size - size - MD_SIZE;
+    tail->is_free = true;
+    tail->prev_is_free = false;
+    tail->is_last = md->is_last;
+    md->is_last = false;
+    md->size = size;
+    if (heap->tail == offsetOf(heap, md)) {
+        heap->tail = offsetOf(heap, tail);
+    }
+    heap->blocks++;
+    heap->bytes -= MD_SIZE;
+    histInsert(heap, tail);
+}
+
+static void absorbNext(ShmHeap* heap, ShmBlock* md) {
+    // Grow md over the block that follows it
+    ShmBlock* next_block = nextBlock(md);
+    md->size += next_block->size + MD_SIZE;
+    md->is_last = next_block->is_last;
+    if (heap->tail == offsetOf(heap, next_block)) {
+        heap->tail = offsetOf(heap, md);
+    }
+    heap->blocks--;
+    heap->bytes += MD_SIZE;
+}
+
+static ShmBlock* newBlock(ShmHeap* heap, size_t size) {
+    // Move the break, or grow the last block if it is free
+    ShmBlock* tail = block(heap, heap->tail);
+    if (tail != nullptr && tail->is_free) {
+        if (size - tail->size > heap->capacity - heap->brk) return nullptr;
+        histRemove(heap, tail);
+        heap->brk += size - tail->size;
+        heap->bytes += size - tail->size;
+        tail->size = size;
+        return tail;
+    }
+
+    if (MD_SIZE + size > heap->capacity - heap->brk) return nullptr;
+    ShmBlock* md = (ShmBlock*)((char*)heap + heap->brk);
+    md->size = size;
+    md->prev_is_free = false;
+    md->is_last = true;
+    md->next_free = md->prev_free = 0;
+    if (tail != nullptr) {
+        tail->is_last = false;
+    }
+    heap->tail = heap->brk;
+    heap->brk += MD_SIZE + size;
+    heap->blocks++;
+    heap->bytes += size;
+    return md;
+}
+
+/* ================= Locking Functions ================= */
+
+struct ShmLock {
+    ShmHeap* heap;
+    bool held;
+
+    explicit ShmLock(ShmHeap* heap) : heap(heap), held(false) {
+        int result = pthread_mutex_lock(&heap->mutex);
+        if (result == EOWNERDEAD) {
+            // The owner died, its update may be half done
+            if (heap->updating) heap->broken = true;
+            pthread_mutex_consistent(&heap->mutex);
+            result = 0;
+        }
+        held = result == 0;
+        if (held && heap->broken) {
+            pthread_mutex_unlock(&heap->mutex);
+            held = false;
+        }
+        if (held) heap->updating = true;
+    }
+
+    ~ShmLock() {
+        if (held) {
+            heap->updating = false;
+            pthread_mutex_unlock(&heap->mutex);
+        }
+    }
+};
+
+/* ================== Heap Functions =================== */
+
+static ShmHeap* mapHeap(int fd, size_t capacity) {
+    void* mapped = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return mapped == MAP_FAILED ? nullptr : (ShmHeap*)mapped;
+}
+
+ShmHeap* shm_heap_create(const char* name, size_t capacity) {
+    // A named heap is a POSIX shared memory object, an unnamed one a memfd that
+    // only fork children (or whoever gets the mapping) share
+    size_t page = getpagesize();
+    capacity = (capacity + page - 1) / page * page;
+    if (capacity <= sizeof(ShmHeap)) return nullptr;
+
+    int fd = name != nullptr ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)
+                             : memfd_create("smalloc_shm", 0);
+    if (fd < 0) return nullptr;
+    if (ftruncate(fd, capacity) != 0) {
+        close(fd);
+        if (name != nullptr) shm_unlink(name);
+        return nullptr;
+    }
+    ShmHeap* heap = mapHeap(fd, capacity);
+    if (heap == nullptr) {
+        if (name != nullptr) shm_unlink(name);
+        return nullptr;
+    }
+
+    // The new object is zero filled, so the lists start empty
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&heap->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    heap->capacity = capacity;
+    heap->brk = firstBlock();
+    heap->magic = SHM_MAGIC;
+    return heap;
+}
+
+ShmHeap* shm_heap_open(const char* name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size <= sizeof(ShmHeap)) {
+        close(fd);
+        return nullptr;
+    }
+    ShmHeap* heap = mapHeap(fd, st.st_size);
+    if (heap != nullptr && heap->magic != SHM_MAGIC) {
+        munmap(heap, st.st_size);
+        return nullptr;
+    }
+    return heap;
+}
+
+void shm_heap_close(ShmHeap* heap) {
+    if (heap) munmap(heap, heap->capacity);
+}
+
+int shm_heap_unlink(const char* name) {
+    return shm_unlink(name);
+}
+
+/* ================= Upgraded Functions ================ */
+
+void* shm_smalloc(ShmHeap* heap, size_t size) {
+    // Update size for memory alignment
+    align_memory(&size);
+    if (heap == nullptr || size == 0 || size > heap->capacity)
+        return nullptr;
+
+    ShmLock lock(heap);
+    if (!lock.held) return nullptr;
+
+    // First, check if histogram has a free block with enough space
+    ShmBlock* md = histFind(heap, size);
+    if (md != nullptr) {
+        histRemove(heap, md);
+    } else {
+        md = newBlock(heap, size);
+        if (md == nullptr) return nullptr;
+    }
+    md->is_free = false;
+    split(heap, md, size);
+    return md + 1;
+}
+
+void shm_sfree(ShmHeap* heap, void* p) {
+    if (heap == nullptr || p == nullptr) return;
+
+    ShmLock lock(heap);
+    if (!lock.held) return;
+
+    ShmBlock* md = (ShmBlock*)p - 1;
+    if (md->is_free) return;
+    md->is_free = true;
+
+    // Merge with the free neighbours, then add the block to the histogram
+    ShmBlock* next_block = nextBlock(md);
+    if (next_block != nullptr && next_block->is_free) {
+        histRemove(heap, next_block);
+        absorbNext(heap, md);
+    }
+    ShmBlock* prev_block = prevBlock(md);
+    if (prev_block != nullptr) {
+        histRemove(heap, prev_block);
+        absorbNext(heap, prev_block);
+        md = prev_block;
+    }
+    histInsert(heap, md);
+}
+
+size_t shm_offset(ShmHeap* heap, void* p) {
+    return p == nullptr ? 0 : (char*)p - (char*)heap;
+}
+
+void* shm_pointer(ShmHeap* heap, size_t offset) {
+    return offset == 0 ? nullptr : (char*)heap + offset;
+}
+
+/* ================= Stats Functions =================== */
+
+size_t _shm_num_free_blocks(ShmHeap* heap) {
+    return heap->free_blocks;
+}
+
+size_t _shm_num_free_bytes(ShmHeap* heap) {
+    return heap->free_bytes;
+}
+
+size_t _shm_num_allocated_blocks(ShmHeap* heap) {
+    return heap->blocks;
+}
+
+size_t _shm_num_allocated_bytes(ShmHeap* heap) {
+    return heap->bytes;
+}
@@ -16,4 +16,125 @@ size_t _num_meta_data_bytes();
 size_t _size_meta_data();
 size_t  _size_meta_data();
 
+// ********* TUNING FUNCTIONS ******** //
+#define SMALLOPT_SBRK_CHUNK_MIN 1
+#define SMALLOPT_SBRK_CHUNK_MAX 2
+#define SMALLOPT_HEAP_BACKEND 3
+#define HEAP_SBRK 0
+#define HEAP_SEGMENTS 1
+#define SMALLOPT_MMAP_THRESHOLD 4
+#define SMALLOPT_NUMA_NODES 5
+#define SMALLOPT_STREAM_THRESHOLD 6
+#define SMALLOPT_DEFERRED_COALESCING 7
+#define SMALLOPT_PRESSURE_USAGE 8
+#define SMALLOPT_PRESSURE_PSI 9
+int smallopt(int param, size_t value);
+size_t _num_sbrk_calls();
+size_t _num_sbrk_calls_saved();
+size_t _num_heap_segments();
+size_t _mmap_threshold();
+size_t _num_mmap_threshold_changes();
+
+// ********** NUMA FUNCTIONS ********** //
+// Heap bytes per node, with the segments backend every node has its own arena
+int smalloc_bind_node(int node);
+size_t _num_numa_nodes();
+size_t _num_node_segments(int node);
+size_t _num_node_bytes(int node);
+size_t _num_node_free_bytes(int node);
+
+// ********* BATCH FUNCTIONS ********* //
+// smalloc_batch fills 'out' with 'count' blocks of 'size' bytes, carved from one
+// region when it can, and returns count (0 if it can't get them all). sfree_batch
+// frees the blocks in one pass, null, invalid and repeated pointers are skipped.
+// It doesn't change the array
+size_t smalloc_batch(size_t size, size_t count, void** out);
+void sfree_batch(void** ptrs, size_t count);
+
+// ********* SIZED FUNCTIONS ********* //
+void sfree_sized(void* p, size_t size);
+void* srealloc_sized(void* oldp, size_t old_size, size_t size);
+
+// ********* RESIZE FUNCTIONS ******** //
+// srealloc over-allocates blocks that keep growing, and shrinks blocks in place:
+// the bytes it still copies, and the free pages it gave back to the kernel
+size_t _num_realloc_copied_bytes();
+size_t _num_purged_bytes();
+
+// ******** IN-PLACE FUNCTIONS ******* //
+size_t smalloc_usable_size(void* p);
+size_t sexpand_inplace(void* p, size_t min_size, size_t max_size);
+
+// ********* REGION FUNCTIONS ******** //
+// Region chunks are heap blocks, so they are counted by _num_allocated_*
+struct SRegion;
+SRegion* sregion_create(size_t chunk_size);
+void* sregion_alloc(SRegion* region, size_t size);
+void sregion_reset(SRegion* region, bool keep_chunks);
+void sregion_destroy(SRegion* region);
+size_t _num_region_chunks();
+size_t _num_region_bytes();
+
+// ******* PERSISTENT FUNCTIONS ******* //
+// The heap lives in a file and comes back in the next run (see malloc_4.cpp):
+// open returns 1 when the file was reopened, 0 when it was created, -1 on errors.
+// Close unmaps the file: no other thread may use smalloc & co. meanwhile, and the
+// blocks of the file are gone. Caches that keep freed blocks (smalloc_fixed, the
+// pool resource) must drop theirs without freeing them, when the generation (the
+// number of closes so far) changes or the close event reaches their cache hook
+int spersist_open(const char* path, size_t capacity);
+int spersist_close();
+size_t spersist_generation();
+void spersist_set_root(void* p);
+void* spersist_get_root();
+
+// ********* PAGE MAP FUNCTIONS ****** //
+// smalloc looks every pointer up in a map of the pages it owns: sfree & co. ignore
+// the ones it didn't allocate (debug builds abort), and count them here
+size_t _num_invalid_frees();
+size_t _num_pagemap_bytes();
+
+// ****** MAINTENANCE FUNCTIONS ****** //
+// An optional thread trims the heap, purges big free blocks and merges deferred
+// frees in the background, a fork child starts without it
+int smalloc_maintenance_start(size_t interval_ms);
+int smalloc_maintenance_stop();
+size_t _num_maintenance_steps();
+size_t _num_trimmed_bytes();
+
+// ******** PRESSURE FUNCTIONS ******* //
+// Over SMALLOPT_PRESSURE_USAGE percent of the cgroup's memory.max, or over
+// SMALLOPT_PRESSURE_PSI hundredths of a percent of memory PSI, the heap gives
+// back its free memory and maps large blocks sooner, until the pressure ends.
+// The maintenance thread checks every interval. The root is a prefix for
+// /sys/fs/cgroup and /proc/pressure. Every check under pressure also runs the
+// cache hooks with SMALLOC_EVENT_PRESSURE, spersist_close with
+// SMALLOC_EVENT_PERSIST_CLOSE: they hold the heap lock, so they may only mark their
+// caches to drain or drop (smalloc_fixed.h registers one), not call smalloc & co.
+#define SMALLOC_EVENT_PRESSURE 0
+#define SMALLOC_EVENT_PERSIST_CLOSE 1
+int smalloc_pressure_root(const char* root);
+int smalloc_pressure_check();
+int smalloc_cache_hook(void (*hook)(int event));
+size_t _num_pressure_events();
+
+// ***** SHARED MEMORY FUNCTIONS ****** //
+// malloc_shm.cpp: a heap in memory shared by several processes, any of them can
+// free what another allocated. Pass blocks between processes as offsets, the
+// heap may be mapped at another address in each one. A null name makes a memfd
+// heap, shared with fork children.
+struct ShmHeap;
+ShmHeap* shm_heap_create(const char* name, size_t capacity);
+ShmHeap* shm_heap_open(const char* name);
+void shm_heap_close(ShmHeap* heap);
+int shm_heap_unlink(const char* name);
+void* shm_smalloc(ShmHeap* heap, size_t size);
+void shm_sfree(ShmHeap* heap, void* p);
+size_t shm_offset(ShmHeap* heap, void* p);
+void* shm_pointer(ShmHeap* heap, size_t offset);
+size_t _shm_num_free_blocks(ShmHeap* heap);
+size_t _shm_num_free_bytes(ShmHeap* heap);
+size_t _shm_num_allocated_blocks(ShmHeap* heap);
+size_t _shm_num_allocated_bytes(ShmHeap* heap);
+
 #endif //SMALLOC_H
@@ -0,0 +1,211 @@
+#ifndef SMALLOC_ALLOCATOR_H
+#define SMALLOC_ALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+#include <memory_resource>
+#include "os_malloc.h"
+
+// Containers on top of smalloc:
+//   std::vector<int, SmallocAllocator<int>> v;
+//   std::pmr::vector<int> v(smalloc_resource());
+//   SmallocPoolResource pool(sizeof(node)); std::pmr::list<int> l(&pool);
+// smalloc returns 8 byte aligned blocks, over-aligned types go through the pmr resource.
+// smalloc(0) fails, so a request for 0 bytes gets a block of 1 byte.
+
+// ********* STD ALLOCATOR ********* //
+
+template <class T>
+class SmallocAllocator {
+public:
+    typedef T value_type;
+
+    SmallocAllocator() noexcept {}
+
+    template <class U>
+    SmallocAllocator(const SmallocAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        static_assert(alignof(T) <= 8, "smalloc blocks are only 8 byte aligned");
+        if (n > MAX_ELEMENTS) throw std::bad_array_new_length();
+        void* p = smalloc(n != 0 ? n * sizeof(T) : 1);
+        if (!p) throw std::bad_alloc();
+        return (T*)p;
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        sfree_sized(p, n * sizeof(T));
+    }
+
+    // Not part of std::allocator: grows or shrinks trivially copyable storage,
+    // in place when the heap allows it
+    T* reallocate(T* p, size_t old_n, size_t new_n) {
+        if (new_n > MAX_ELEMENTS) throw std::bad_array_new_length();
+        void* new_p = srealloc_sized(p, old_n * sizeof(T), new_n != 0 ? new_n * sizeof(T) : 1);
+        if (!new_p) throw std::bad_alloc();
+        return (T*)new_p;
+    }
+
+private:
+    static const size_t MAX_ELEMENTS = 100000000 / sizeof(T);
+};
+
+template <class T, class U>
+bool operator==(const SmallocAllocator<T>&, const SmallocAllocator<U>&) noexcept {
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const SmallocAllocator<T>&, const SmallocAllocator<U>&) noexcept {
+    return false;
+}
+
+// ********* PMR RESOURCES ********* //
+
+// Any alignment: blocks aligned past 8 bytes are over-allocated, and the
+// pointer smalloc returned is kept right before the aligned one
+class SmallocResource : public std::pmr::memory_resource {
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        if (alignment <= 8) {
+            void* p = smalloc(bytes != 0 ? bytes : 1);
+            if (!p) throw std::bad_alloc();
+            return p;
+        }
+
+        void* p = smalloc(bytes + alignment + sizeof(void*));
+        if (!p) throw std::bad_alloc();
+        size_t aligned = ((size_t)p + sizeof(void*) + alignment - 1) & ~(alignment - 1);
+        ((void**)aligned)[-1] = p;
+        return (void*)aligned;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        if (alignment <= 8) {
+            sfree_sized(p, bytes);
+        } else {
+            sfree(((void**)p)[-1]);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return dynamic_cast<const SmallocResource*>(&other) != nullptr;
+    }
+};
+
+inline SmallocResource* smalloc_resource() noexcept {
+    static SmallocResource resource;
+    return &resource;
+}
+
+// Hands out blocks of one size from its own free list, for the nodes of lists,
+// maps and sets. The list is refilled BATCH blocks at a time with smalloc_batch,
+// other sizes go to the upstream resource. Like std::pmr::unsynchronized_pool_resource
+// it is for one thread, and release() (or the destructor) frees all of its blocks.
+// Blocks taken before spersist_close are forgotten, not freed: the file is gone.
+class SmallocPoolResource : public std::pmr::memory_resource {
+public:
+    static const size_t BATCH = 64;
+
+    explicit SmallocPoolResource(size_t block_size,
+                                 std::pmr::memory_resource* upstream = smalloc_resource())
+        : block_size((block_size + 7) & ~(size_t)7), upstream(upstream),
+          free_list(nullptr), batches(nullptr), generation(spersist_generation()) {
+        if (this->block_size < sizeof(void*)) this->block_size = sizeof(void*);
+    }
+
+    SmallocPoolResource(const SmallocPoolResource&) = delete;
+    SmallocPoolResource& operator=(const SmallocPoolResource&) = delete;
+
+    ~SmallocPoolResource() override {
+        release();
+    }
+
+    void release() {
+        // Every block ever taken is listed in its batch, handed out or not
+        if (stale()) return;
+        while (batches != nullptr) {
+            Batch* next = batches->next;
+            sfree_batch(batches->blocks, BATCH);
+            sfree(batches);
+            batches = next;
+        }
+        free_list = nullptr;
+    }
+
+    size_t blockSize() const {
+        return block_size;
+    }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        if (bytes > block_size || alignment > 8) {
+            return upstream->allocate(bytes, alignment);
+        }
+        if (stale() || free_list == nullptr) refill();
+
+        FreeBlock* block = free_list;
+        free_list = block->next;
+        return block;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        if (bytes > block_size || alignment > 8) {
+            upstream->deallocate(p, bytes, alignment);
+            return;
+        }
+        if (stale()) return;
+        FreeBlock* block = (FreeBlock*)p;
+        block->next = free_list;
+        free_list = block;
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct Batch {
+        Batch* next;
+        void* blocks[BATCH];
+    };
+
+    bool stale() {
+        // The batches were in the persistent heap spersist_close unmapped
+        size_t now = spersist_generation();
+        if (now == generation) return false;
+        free_list = nullptr;
+        batches = nullptr;
+        generation = now;
+        return true;
+    }
+
+    void refill() {
+        Batch* batch = (Batch*)smalloc(sizeof(Batch));
+        if (!batch) throw std::bad_alloc();
+        if (smalloc_batch(block_size, BATCH, batch->blocks) != BATCH) {
+            sfree(batch);
+            throw std::bad_alloc();
+        }
+        batch->next = batches;
+        batches = batch;
+
+        for (size_t i = BATCH; i > 0; i--) {
+            FreeBlock* block = (FreeBlock*)batch->blocks[i - 1];
+            block->next = free_list;
+            free_list = block;
+        }
+    }
+
+    size_t block_size;
+    std::pmr::memory_resource* upstream;
+    FreeBlock* free_list;
+    Batch* batches;
+    size_t generation;  // spersist_generation() of the batches
+};
+
+#endif //SMALLOC_ALLOCATOR_H
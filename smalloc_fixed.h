@@ -0,0 +1,404 @@
+#ifndef SMALLOC_FIXED_H
+#define SMALLOC_FIXED_H
+
+#include <atomic>
+#include <cstddef>
+#include "os_malloc.h"
+
+#if defined(__x86_64__) && !defined(SMALLOC_DEBUG) && __has_include(<sys/rseq.h>)
+#define FIXED_RSEQ
+#include <sys/mman.h>
+#include <sys/rseq.h>
+#endif
+
+// smalloc_fixed<N>() / sfree_fixed<N>(p) for sizes known at compile time.
+// The alignment, the size class and the path are worked out by the compiler:
+//   FIXED_CACHE: N up to FIXED_CACHE_MAX, a pop or push on a free list of that
+//                class, refilled and drained with the batch API. The list is the
+//                current CPU's, a restartable sequence (rseq) makes the pop and push
+//                lock free, so thousands of threads share a few lists. Without rseq
+//                (old glibc, other architectures) every thread has its own list
+//   FIXED_HEAP:  anything bigger goes straight to smalloc with the aligned size,
+//                which also decides between the heap and mmap
+// The blocks are ordinary smalloc blocks, so sfree and sfree_fixed can be mixed.
+// Debug builds (-DSMALLOC_DEBUG) skip the caches, so every block is checked.
+// Both are safe in a signal handler: a handler that interrupts its thread's own
+// list goes to smalloc / sfree_sized instead, which fail (nullptr, or a leaked
+// block) rather than deadlock; an interrupted per-CPU sequence just restarts.
+// After fork the child keeps the forking thread's lists and the per-CPU lists,
+// the blocks in the lists of the other threads stay allocated.
+// Under memory pressure the heap bumps fixed_drain_epoch through its cache hook.
+// The next smalloc_fixed or sfree_fixed of a class in a thread then drains that
+// thread's list, or the list of the CPU it runs on. Lists nobody uses stay as they are.
+// spersist_close unmaps the blocks of the file: its hook also bumps
+// fixed_discard_epoch and empties the per-CPU lists, and a thread list of an older
+// discard epoch is dropped, not drained, the next time its thread uses it.
+
+#define FIXED_CACHE_MAX 1024
+#define FIXED_BATCH 32
+#define FIXED_CACHED_MAX (4 * FIXED_BATCH)
+#define FIXED_CPUS_MAX 1024
+#define FIXED_SLOTS 31
+
+enum FixedPath { FIXED_CACHE, FIXED_HEAP };
+
+constexpr size_t fixedSize(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+constexpr FixedPath fixedPath([[maybe_unused]] size_t n) {
+#ifdef SMALLOC_DEBUG
+    return FIXED_HEAP;
+#else
+    return fixedSize(n) <= FIXED_CACHE_MAX ? FIXED_CACHE : FIXED_HEAP;
+#endif
+}
+
+struct FixedBlock {
+    FixedBlock* next;
+};
+
+inline std::atomic<unsigned int> fixed_drain_epoch{0};
+inline std::atomic<unsigned int> fixed_discard_epoch{0};
+inline std::atomic<bool> fixed_hooked{false};
+
+inline void fixedDiscardCpuLists();
+
+inline void fixedEvent(int event) {
+    // Runs under the heap lock, the lists are drained by their own threads
+    if (event == SMALLOC_EVENT_PERSIST_CLOSE) {
+        fixed_discard_epoch.fetch_add(1, std::memory_order_relaxed);
+        fixedDiscardCpuLists();
+    }
+    fixed_drain_epoch.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void fixedHook() {
+    // Once, from the first refill. A refill in a signal handler may not get the lock
+    if (!fixed_hooked.load(std::memory_order_relaxed) && !fixed_hooked.exchange(true) &&
+            !smalloc_cache_hook(fixedEvent))
+        fixed_hooked = false;
+}
+
+// The free list of one size class in one thread, given back when the thread exits
+struct FixedCache {
+    FixedBlock* head;
+    size_t count;
+    size_t size;
+    bool busy;  // set while the thread changes the list, a signal handler leaves it alone
+    unsigned int epoch;  // fixed_discard_epoch of the blocks in the list
+
+    void enter() {
+        busy = true;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
+
+    void leave() {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        busy = false;
+    }
+
+    bool refill() {
+        fixedHook();
+        void* blocks[FIXED_BATCH];
+        if (smalloc_batch(size, FIXED_BATCH, blocks) != FIXED_BATCH)
+            return false;
+        for (size_t i = FIXED_BATCH; i > 0; i--) {
+            FixedBlock* block = (FixedBlock*)blocks[i - 1];
+            block->next = head;
+            head = block;
+        }
+        count += FIXED_BATCH;
+        return true;
+    }
+
+    void drain(size_t keep) {
+        // Give back the blocks above 'keep', a batch at a time
+        void* blocks[FIXED_BATCH];
+        while (count > keep) {
+            size_t n = 0;
+            while (n < FIXED_BATCH && count > keep) {
+                blocks[n++] = head;
+                head = head->next;
+                count--;
+            }
+            sfree_batch(blocks, n);
+        }
+    }
+
+    void discard() {
+        // The heap the blocks came from is gone, forget them
+        head = nullptr;
+        count = 0;
+        epoch = fixed_discard_epoch.load(std::memory_order_relaxed);
+    }
+
+    ~FixedCache() {
+        if (epoch == fixed_discard_epoch.load(std::memory_order_relaxed))
+            drain(0);
+    }
+};
+
+#ifdef FIXED_RSEQ
+
+// The free list of one size class on one CPU, a stack of up to FIXED_SLOTS blocks.
+// It takes 256 bytes, so the sequences below find a CPU's list with a shift
+struct alignas(256) FixedCpuList {
+    size_t top;
+    void* slots[FIXED_SLOTS];
+};
+
+static_assert(sizeof(FixedCpuList) == 256, "a CPU's list is found with a shift by 8");
+
+// False when glibc didn't register rseq for the threads, the thread lists are used then
+inline bool fixed_per_cpu = __rseq_size > 0;
+
+inline struct rseq* fixedRseq() {
+    return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+}
+
+// A restartable sequence runs from 1: to the commit store before 2:. If the thread is
+// preempted, migrated or signaled in between, the kernel moves it to 4:, which starts
+// over. The abort handler follows the signature glibc registered rseq with.
+#define FIXED_RSEQ_START                                                    \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                                    \
+    ".balign 32\n\t"                                                        \
+    "3:\n\t"                                                                \
+    ".long 0, 0\n\t"                                                        \
+    ".quad 1f, (2f - 1f), 4f\n\t"                                           \
+    ".popsection\n\t"                                                       \
+    "leaq 3b(%%rip), %%rax\n\t"                                             \
+    "movq %%rax, %c[cs_offset](%[rseq])\n\t"                                \
+    "1:\n\t"                                                                \
+    "movl %c[cpu_offset](%[rseq]), %%eax\n\t"                               \
+    "cmpl %[cpus], %%eax\n\t"                                               \
+    "jae %l[slow]\n\t"                                                      \
+    "shlq $8, %%rax\n\t"                                                    \
+    "addq %[lists], %%rax\n\t"                                              \
+    "movq (%%rax), %%rcx\n\t"
+
+#define FIXED_RSEQ_END                                                      \
+    "2:\n\t"                                                                \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                               \
+    ".long 0x53053053\n\t"                                                  \
+    "4:\n\t"                                                                \
+    "jmp %l[retry]\n\t"                                                     \
+    ".popsection\n\t"
+
+#define FIXED_RSEQ_OPERANDS                                                 \
+    [rseq] "r" (fixedRseq()), [lists] "r" (lists), [cpus] "i" (FIXED_CPUS_MAX), \
+    [cs_offset] "i" (offsetof(struct rseq, rseq_cs)),                       \
+    [cpu_offset] "i" (offsetof(struct rseq, cpu_id))
+
+// Pops a block from the current CPU's list, nullptr when it is empty
+inline void* cpuPop(FixedCpuList* lists) {
+    void* block;
+retry:
+    asm goto(FIXED_RSEQ_START
+             "testq %%rcx, %%rcx\n\t"
+             "jz %l[slow]\n\t"
+             "movq (%%rax, %%rcx, 8), %%rdx\n\t"
+             "movq %%rdx, (%[block])\n\t"
+             "subq $1, %%rcx\n\t"
+             "movq %%rcx, (%%rax)\n\t"
+             FIXED_RSEQ_END
+             :
+             : FIXED_RSEQ_OPERANDS, [block] "r" (&block)
+             : "rax", "rcx", "rdx", "memory", "cc"
+             : slow, retry);
+    return block;
+slow:
+    return nullptr;
+}
+
+// Pushes a block on the current CPU's list, false when it is full
+inline bool cpuPush(FixedCpuList* lists, void* block) {
+retry:
+    asm goto(FIXED_RSEQ_START
+             "cmpq %[slots], %%rcx\n\t"
+             "jae %l[slow]\n\t"
+             "movq %[block], 8(%%rax, %%rcx, 8)\n\t"
+             "addq $1, %%rcx\n\t"
+             "movq %%rcx, (%%rax)\n\t"
+             FIXED_RSEQ_END
+             :
+             : FIXED_RSEQ_OPERANDS, [block] "r" (block), [slots] "i" (FIXED_SLOTS)
+             : "rax", "rcx", "memory", "cc"
+             : slow, retry);
+    return true;
+slow:
+    return false;
+}
+
+inline FixedCpuList* cpuLists(std::atomic<FixedCpuList*>& lists) {
+    // Mapped on first use, only the lists of the CPUs that run the class get pages
+    FixedCpuList* mapped = lists.load(std::memory_order_acquire);
+    if (mapped != nullptr) return mapped;
+
+    void* fresh = mmap(NULL, FIXED_CPUS_MAX * sizeof(FixedCpuList), PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (fresh == MAP_FAILED) return nullptr;
+    if (!lists.compare_exchange_strong(mapped, (FixedCpuList*)fresh)) {
+        munmap(fresh, FIXED_CPUS_MAX * sizeof(FixedCpuList));
+        return mapped;
+    }
+    return (FixedCpuList*)fresh;
+}
+
+inline void* cpuRefill(FixedCpuList* lists, size_t size) {
+    // Half a list from the batch API, the first block goes to the caller. The
+    // thread may have moved, whatever the new CPU's list has no room for goes back
+    fixedHook();
+    void* blocks[FIXED_SLOTS / 2 + 1];
+    size_t count = smalloc_batch(size, FIXED_SLOTS / 2 + 1, blocks);
+    if (count == 0) return nullptr;
+    size_t left = 0;
+    for (size_t i = 1; i < count; i++) {
+        if (!cpuPush(lists, blocks[i])) blocks[1 + left++] = blocks[i];
+    }
+    if (left > 0) sfree_batch(blocks + 1, left);
+    return blocks[0];
+}
+
+inline void cpuDrain(FixedCpuList* lists, void* block) {
+    // The list is full: give back half of it together with the block
+    void* blocks[FIXED_SLOTS / 2 + 1];
+    size_t count = 0;
+    blocks[count++] = block;
+    while (count < FIXED_SLOTS / 2 + 1 && (blocks[count] = cpuPop(lists)) != nullptr) {
+        count++;
+    }
+    sfree_batch(blocks, count);
+}
+
+// The lists of every class, index size / 8 - 1, so spersist_close can empty them
+inline std::atomic<FixedCpuList*> fixed_cpu_lists[FIXED_CACHE_MAX / 8];
+
+inline void fixedDiscardCpuLists() {
+    // Zero pages: every top goes back to 0. No thread is in a sequence, close
+    // requires that nobody else uses the allocator
+    for (std::atomic<FixedCpuList*>& lists : fixed_cpu_lists) {
+        FixedCpuList* mapped = lists.load(std::memory_order_acquire);
+        if (mapped != nullptr)
+            madvise(mapped, FIXED_CPUS_MAX * sizeof(FixedCpuList), MADV_DONTNEED);
+    }
+}
+
+inline void cpuDrainAll(FixedCpuList* lists) {
+    // Pressure: give back the whole list of the current CPU
+    void* blocks[FIXED_SLOTS];
+    size_t count = 0;
+    while (count < FIXED_SLOTS && (blocks[count] = cpuPop(lists)) != nullptr) {
+        count++;
+    }
+    sfree_batch(blocks, count);
+}
+
+#else
+
+inline void fixedDiscardCpuLists() {
+}
+
+#endif
+
+template <size_t SIZE>
+struct FixedClass {
+    static thread_local FixedCache cache;
+    static inline thread_local unsigned int drained = 0;  // fixed_drain_epoch at the last drain
+#ifdef FIXED_RSEQ
+    static inline std::atomic<FixedCpuList*>& cpu_lists = fixed_cpu_lists[SIZE / 8 - 1];
+#endif
+};
+
+template <size_t SIZE>
+thread_local FixedCache FixedClass<SIZE>::cache = {nullptr, 0, SIZE, false, 0};
+
+template <size_t SIZE>
+__attribute__((noinline)) void fixedDrainClass() {
+    // The heap asked for its blocks back: the thread's list of the class, or the
+    // list of the CPU it runs on. A list from before spersist_close is dropped
+    FixedClass<SIZE>::drained = fixed_drain_epoch.load(std::memory_order_relaxed);
+#ifdef FIXED_RSEQ
+    FixedCpuList* lists = fixed_per_cpu ? cpuLists(FixedClass<SIZE>::cpu_lists) : nullptr;
+    if (lists != nullptr) {
+        cpuDrainAll(lists);
+        return;
+    }
+#endif
+    FixedCache& cache = FixedClass<SIZE>::cache;
+    if (cache.busy) return;
+    cache.enter();
+    if (cache.epoch != fixed_discard_epoch.load(std::memory_order_relaxed))
+        cache.discard();
+    else
+        cache.drain(0);
+    cache.leave();
+}
+
+template <size_t N>
+inline void* smalloc_fixed() {
+    static_assert(N > 0 && N <= 100000000, "smalloc sizes are 1 to 100000000 bytes");
+    constexpr size_t size = fixedSize(N);
+
+    if constexpr (fixedPath(N) == FIXED_CACHE) {
+#ifdef FIXED_RSEQ
+        FixedCpuList* lists = fixed_per_cpu ? cpuLists(FixedClass<size>::cpu_lists) : nullptr;
+        if (lists != nullptr) {
+            void* block = cpuPop(lists);
+            return block != nullptr ? block : cpuRefill(lists, size);
+        }
+#endif
+        FixedCache& cache = FixedClass<size>::cache;
+        if (cache.busy)
+            return smalloc(size);
+        cache.enter();
+        if (cache.epoch != fixed_discard_epoch.load(std::memory_order_relaxed))
+            cache.discard();
+        FixedBlock* block = nullptr;
+        if (cache.head != nullptr || cache.refill()) {
+            block = cache.head;
+            cache.head = block->next;
+            cache.count--;
+        }
+        cache.leave();
+        return block;
+    } else {
+        return smalloc(size);
+    }
+}
+
+template <size_t N>
+inline void sfree_fixed(void* p) {
+    constexpr size_t size = fixedSize(N);
+    if (!p) return;
+
+    if constexpr (fixedPath(N) == FIXED_CACHE) {
+        if (FixedClass<size>::drained != fixed_drain_epoch.load(std::memory_order_relaxed))
+            fixedDrainClass<size>();
+#ifdef FIXED_RSEQ
+        FixedCpuList* lists = fixed_per_cpu ? cpuLists(FixedClass<size>::cpu_lists) : nullptr;
+        if (lists != nullptr) {
+            if (!cpuPush(lists, p)) cpuDrain(lists, p);
+            return;
+        }
+#endif
+        FixedCache& cache = FixedClass<size>::cache;
+        if (cache.busy) {
+            sfree_sized(p, size);
+            return;
+        }
+        cache.enter();
+        if (cache.epoch != fixed_discard_epoch.load(std::memory_order_relaxed))
+            cache.discard();
+        FixedBlock* block = (FixedBlock*)p;
+        block->next = cache.head;
+        cache.head = block;
+        if (++cache.count > FIXED_CACHED_MAX)
+            cache.drain(FIXED_CACHED_MAX - FIXED_BATCH);
+        cache.leave();
+    } else {
+        sfree_sized(p, size);
+    }
+}
+
+#endif //SMALLOC_FIXED_H
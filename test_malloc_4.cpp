@@ -0,0 +1,1661 @@
+/*
+HOW TO RUN?
+	g++ -std=c++17 -pthread test_malloc_4.cpp -o test_malloc_4
+	./test_malloc_4
+	(add -DSMALLOC_DEBUG or -DSMALLOC_GUARD_PAGES to also run the debug build tests)
+
+NOTE: like the tamuz tests, every test runs in a child process, so each one starts with a clean heap.
+      the tests only use smalloc & co. from the worker threads, glibc's malloc shares the break with us.
+ */
+
+#include "malloc_4.cpp"
+#include "smalloc_allocator.h"
+#include "smalloc_fixed.h"
+#include <vector>
+#include <map>
+#include <list>
+#include <unistd.h>
+#include <assert.h>
+#include <cstdlib>
+#include <csignal>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <iostream>
+
+/*******************************************************************************
+ *  AUXILIARY FUNCTIONS
+ ******************************************************************************/
+
+const int THREADS = 8, SLOTS = 64;
+volatile bool stop_workers = false;
+
+/* Keeps SLOTS blocks of changing sizes alive, and checks their contents. */
+void* allocating_worker(void* arg) {
+    size_t state = (size_t)arg;
+    unsigned char* slots[SLOTS] = {};
+    size_t sizes[SLOTS] = {};
+
+    while (!stop_workers) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        int i = (state >> 33) % SLOTS;
+        if (slots[i] != nullptr) {
+            assert(slots[i][0] == (unsigned char)sizes[i] && slots[i][sizes[i] - 1] == (unsigned char)sizes[i]);
+            sfree(slots[i]);
+        }
+        sizes[i] = 1 + (state >> 40) % ((state & 1) ? 200 * KB : 2 * KB);
+        slots[i] = (unsigned char*)smalloc(sizes[i]);
+        assert(slots[i] != nullptr);
+        memset(slots[i], (unsigned char)sizes[i], sizes[i]);
+    }
+
+    for (int i = 0; i < SLOTS; i++) {
+        sfree(slots[i]);
+    }
+    return nullptr;
+}
+
+/* Debug builds keep freed blocks allocated for a while, give them back before counting. */
+void flush_quarantine() {
+#ifdef SMALLOC_DEBUG
+    HeapLock lock;
+    quarantineFlush();
+#endif
+}
+
+void start_workers(pthread_t* threads) {
+    stop_workers = false;
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&threads[i], nullptr, allocating_worker, (void*)(size_t)(i + 1)) == 0);
+    }
+}
+
+void join_workers(pthread_t* threads) {
+    stop_workers = true;
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+}
+
+/* Walks the sbrk heap block by block, and the mmap list, and checks the counters. */
+void check_counters() {
+    size_t free_blocks = 0, free_bytes = 0, blocks = 0, bytes = 0;
+    bool prev_free = false;
+    for (MetaData* md = memory_list; md != nullptr; md = nextBlock(md)) {
+        assert(md->prev_is_free == prev_free && !(prev_free && md->is_free));
+        if (prev_free) assert(nextBlock(prevBlock(md)) == md);
+        blocks++;
+        bytes += md->size;
+        if (md->is_free) {
+            free_blocks++;
+            free_bytes += md->size;
+        }
+        prev_free = md->is_free;
+    }
+    for (MetaData* md = mmap_list; md != nullptr; md = md->next_free) {
+        blocks++;
+        bytes += md->size;
+    }
+    assert(_num_free_blocks() == free_blocks && _num_free_bytes() == free_bytes);
+    assert(_num_allocated_blocks() == blocks && _num_allocated_bytes() == bytes);
+}
+
+/* Runs func in a child and checks that it is killed by the given signal. */
+void expect_signal(void (*func)(), int signal_number) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        func();
+        _exit(0);
+    }
+    int exit_status = 0;
+    waitpid(pid, &exit_status, 0);
+    assert(WIFSIGNALED(exit_status) && WTERMSIG(exit_status) == signal_number);
+}
+
+/*******************************************************************************
+ *  TESTS
+ ******************************************************************************/
+
+void test_batch_functions() {
+    assert(smallopt(SMALLOPT_HEAP_BACKEND, HEAP_SBRK) == 1);
+    size_t allocated = _num_allocated_blocks() - _num_free_blocks();
+    static void* blocks[100];
+    assert(smalloc_batch(100, 0, blocks) == 0);
+    assert(smalloc_batch(0, 4, blocks) == 0);
+    sfree_batch(blocks, 0);
+    sfree_batch(nullptr, 4);
+
+    // the whole batch is carved out of one free block
+    char* big = (char*)smalloc(20 * KB);
+    void* pin = smalloc(16);
+    sfree(big);
+    flush_quarantine();
+    assert(smalloc_batch(100, 100, blocks) == 100);
+#ifndef SMALLOC_DEBUG
+    assert(blocks[0] == big);
+    for (int i = 1; i < 100; i++) {
+        assert((char*)blocks[i] == (char*)blocks[i - 1] + 104 + _size_meta_data());
+    }
+#endif
+    for (int i = 0; i < 100; i++) {
+        memset(blocks[i], i, 100);
+    }
+
+#ifndef SMALLOC_DEBUG
+    // freed in any order, with repeated, null and foreign pointers among them, the
+    // blocks merge back into one, and the caller's array stays as it was
+    static void* ptrs[104];
+    static void* copy[104];
+    for (int i = 0; i < 100; i++) {
+        ptrs[i] = blocks[(i * 37) % 100];
+    }
+    int not_ours = 0;
+    ptrs[100] = blocks[5];
+    ptrs[101] = nullptr;
+    ptrs[102] = &not_ours;
+    ptrs[103] = blocks[0];
+    memcpy(copy, ptrs, sizeof(ptrs));
+    size_t invalid = _num_invalid_frees();
+    sfree_batch(ptrs, 104);
+    assert(memcmp(copy, ptrs, sizeof(ptrs)) == 0);
+    assert(_num_invalid_frees() == invalid + 1);
+    MetaData* merged = (MetaData*)big - 1;
+    assert(merged->is_free && nextBlock(merged) == (MetaData*)pin - 1);
+    check_counters();
+
+    // more blocks than are sorted at once still end up merged
+    static void* many[3 * BATCH_SORT_MAX];
+    assert(smalloc_batch(64, 3 * BATCH_SORT_MAX, many) == 3 * BATCH_SORT_MAX);
+    for (int i = 0; i < 3 * BATCH_SORT_MAX; i++) {
+        std::swap(many[i], many[(i * 7919) % (3 * BATCH_SORT_MAX)]);
+    }
+    sfree_batch(many, 3 * BATCH_SORT_MAX);
+    check_counters();
+#else
+    sfree_batch(blocks, 100);
+    flush_quarantine();
+#endif
+
+    sfree(pin);
+    flush_quarantine();
+    assert(_num_allocated_blocks() - _num_free_blocks() == allocated);
+}
+
+void test_sized_functions() {
+    size_t allocated = _num_allocated_blocks() - _num_free_blocks();
+
+    // srealloc_sized keeps the data, on the heap and between the heap and mmap
+    char* p = (char*)srealloc_sized(nullptr, 0, 100);
+    assert(p != nullptr);
+    memset(p, 's', 100);
+    p = (char*)srealloc_sized(p, 100, 300);
+    assert(p != nullptr && p[99] == 's');
+    p = (char*)srealloc_sized(p, 300, 200 * KB);
+    assert(p != nullptr && p[0] == 's' && p[99] == 's');
+    assert(srealloc_sized(p, 200 * KB, 0) == nullptr);
+    char* q = (char*)smalloc(50);
+
+    // sfree_sized gives back heap and mmap blocks
+    sfree_sized(p, 200 * KB);
+    sfree_sized(q, 50);
+    sfree_sized(nullptr, 8);
+    flush_quarantine();
+    assert(_num_allocated_blocks() - _num_free_blocks() == allocated);
+
+#ifdef SMALLOC_DEBUG
+    // a size larger than the block is caught in debug builds
+    expect_signal([] { sfree_sized(smalloc(100), 101); }, SIGABRT);
+    expect_signal([] { srealloc_sized(smalloc(100), 200, 300); }, SIGABRT);
+#else
+    // and trusted otherwise, the header decides
+    p = (char*)smalloc(100);
+    sfree_sized(p, 1000);
+    assert(_num_allocated_blocks() - _num_free_blocks() == allocated);
+#endif
+}
+
+void test_regions() {
+    size_t allocated = _num_allocated_blocks() - _num_free_blocks();
+    assert(sregion_create(8) == nullptr);
+    assert(sregion_alloc(nullptr, 8) == nullptr);
+
+    // objects are bumped out of a chunk, aligned, without headers
+    SRegion* region = sregion_create(4 * KB);
+    assert(region != nullptr && sregion_alloc(region, 0) == nullptr);
+    char* a = (char*)sregion_alloc(region, 10);
+    char* b = (char*)sregion_alloc(region, 10);
+    assert(a != nullptr && b == a + 16);
+    assert(_num_region_chunks() == 1 && _num_region_bytes() == 32);
+
+    // a full chunk is followed by a new one, a big object gets a chunk of its own
+    char* c = (char*)sregion_alloc(region, 4050);
+    assert(c != nullptr && (c < a || c > a + 4 * KB));
+    char* big = (char*)sregion_alloc(region, 10 * KB);
+    assert(big != nullptr);
+    memset(big, 'b', 10 * KB);
+    assert(_num_region_chunks() == 3 && _num_region_bytes() == 32 + 4056 + 10 * KB);
+
+    // a second region is counted too
+    SRegion* other = sregion_create(0);
+    assert(sregion_alloc(other, 100) != nullptr);
+    assert(_num_region_chunks() == 4 && _num_region_bytes() == 32 + 4056 + 10 * KB + 104);
+
+    // a reset that keeps the chunks rewinds them, the next object starts over
+    sregion_reset(region, true);
+    assert(_num_region_chunks() == 4 && _num_region_bytes() == 104);
+    assert(sregion_alloc(region, 10) == a);
+
+    // one that doesn't gives them back to the heap
+    sregion_reset(region, false);
+    assert(_num_region_chunks() == 1 && _num_region_bytes() == 104);
+    assert(sregion_alloc(region, 10) != nullptr && _num_region_chunks() == 2);
+
+    // destroy frees the chunks and the region itself
+    sregion_destroy(region);
+    sregion_destroy(other);
+    sregion_destroy(nullptr);
+    flush_quarantine();
+    assert(_num_region_chunks() == 0 && _num_region_bytes() == 0);
+    assert(_num_allocated_blocks() - _num_free_blocks() == allocated);
+}
+
+void test_expand_inplace() {
+    assert(smallopt(SMALLOPT_HEAP_BACKEND, HEAP_SBRK) == 1);
+    char* p = (char*)smalloc(100);
+    assert(sexpand_inplace(nullptr, 8, 8) == 0);
+#ifdef SMALLOC_DEBUG
+    // the canary follows the requested bytes, so only they are usable
+    assert(sexpand_inplace(p, 50, 200) == 100 && sexpand_inplace(p, 101, 200) == 0);
+#else
+    // the block's own slack
+    assert(sexpand_inplace(p, 50, 200) == 104);
+
+    // a free next block, the rest of it is split off again
+    char* a = (char*)smalloc(1000);
+    char* b = (char*)smalloc(1000);
+    void* pin = smalloc(16);
+    memset(a, 'a', 1000);
+    sfree(b);
+    size_t free_bytes = _num_free_bytes();
+    assert(sexpand_inplace(a, 1500, 1500) == 1504);
+    assert(a[999] == 'a' && _num_free_bytes() == free_bytes - 504);
+
+    // a next block that is too small is left alone
+    size_t free_blocks = _num_free_blocks();
+    assert(sexpand_inplace(a, 10000, 20000) == 0);
+    assert(smalloc_usable_size(a) == 1504 && _num_free_blocks() == free_blocks);
+
+    // the wilderness grows, to max_size when it can
+    char* tail = (char*)smalloc(1000);
+    memset(tail, 't', 1000);
+    assert(sexpand_inplace(tail, 50 * KB, 60 * KB) == 60 * KB);
+    assert(tail[999] == 't' && (char*)sbrk(0) >= tail + 60 * KB);
+
+    // if it can't, the free wilderness merged into the block is given back
+    sfree(smalloc(1000));
+    free_blocks = _num_free_blocks();
+    free_bytes = _num_free_bytes();
+    size_t allocated = _num_allocated_blocks();
+    assert(sbrk(64) != (void*)(-1));  // someone else moved the break
+    assert(sexpand_inplace(tail, 1024 * KB, 1024 * KB) == 0);
+    assert(smalloc_usable_size(tail) == 60 * KB);
+    assert(_num_free_blocks() == free_blocks && _num_free_bytes() == free_bytes);
+    assert(_num_allocated_blocks() == allocated);
+
+    // a mapping grows in place with mremap when the pages after it are unused:
+    // mappings are placed top down, so 'above' usually ends up right after 'mapped'
+    char* above = (char*)smalloc(200 * KB);
+    char* mapped = (char*)smalloc(200 * KB);
+    memset(mapped, 'm', 200 * KB);
+    size_t capacity = smalloc_usable_size(mapped);
+    if (mapped + capacity == above - MD_SIZE) {
+        sfree(above);
+        assert(sexpand_inplace(mapped, 300 * KB, 300 * KB) >= 300 * KB);
+        assert(mapped[200 * KB - 1] == 'm');
+        memset(mapped, 'm', 300 * KB);
+        capacity = smalloc_usable_size(mapped);
+        above = nullptr;
+    }
+    char* end = mapped + capacity;
+    void* taken = mmap(end, getpagesize(), PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    assert(taken == end || errno == EEXIST);
+
+    // and keeps its size when they are taken
+    assert(sexpand_inplace(mapped, capacity + 64 * KB, capacity + 64 * KB) == 0);
+    assert(smalloc_usable_size(mapped) == capacity);
+    sfree(mapped);
+    sfree(above);
+    sfree(tail);
+    sfree(a);
+    sfree(pin);
+#endif
+    sfree(p);
+}
+
+void test_best_fit_tree() {
+    // free blocks of different sizes, kept apart by pins
+    const size_t sizes[] = {3000, 2000, 5000, 2000, 1500, 600, 300};
+    const int count = sizeof(sizes) / sizeof(sizes[0]);
+    void* blocks[count];
+    void* pins[count];
+    for (int i = 0; i < count; i++) {
+        blocks[i] = smalloc(sizes[i]);
+        pins[i] = smalloc(16);
+    }
+    for (int i = 0; i < count; i++) {
+        sfree(blocks[i]);
+    }
+    flush_quarantine();
+
+    // the smallest block that fits wins, the lowest address among equal sizes
+    assert(smalloc(1900) == blocks[1]);
+    assert(smalloc(1900) == blocks[3]);
+    assert(smalloc(1400) == blocks[4]);
+    assert(smalloc(2500) == blocks[0]);
+    assert(smalloc(4000) == blocks[2]);
+
+    // under TREE_MIN the sorted lists give the same answers
+    assert(smalloc(250) == blocks[6]);
+    assert(smalloc(500) == blocks[5]);
+    for (int i = 0; i < count; i++) {
+        sfree(pins[i]);
+    }
+}
+
+void test_boundary_tags() {
+    assert(smallopt(SMALLOPT_HEAP_BACKEND, HEAP_SBRK) == 1);
+    char* a = (char*)smalloc(1000);
+    char* b = (char*)smalloc(1000);
+    char* c = (char*)smalloc(1000);
+    char* pin = (char*)smalloc(1000);
+    size_t free_blocks = _num_free_blocks();
+
+    // a freed block merges with free neighbours on both sides, found by address
+    sfree(a);
+    sfree(c);
+    flush_quarantine();
+    assert(_num_free_blocks() == free_blocks + 2);
+    sfree(b);
+    flush_quarantine();
+    assert(_num_free_blocks() == free_blocks + 1);
+    MetaData* merged = (MetaData*)a - 1;
+    assert(merged->is_free && nextBlock(merged) == (MetaData*)pin - 1);
+
+    // the block after it finds it through the footer
+    MetaData* after = (MetaData*)pin - 1;
+    assert(after->prev_is_free && prevBlock(after) == merged);
+    check_counters();
+    assert(smalloc(3000) == a && !after->prev_is_free);
+
+    // the counters follow every split and merge
+    char* live[64] = {};
+    size_t state = 1;
+    for (int i = 0; i < 4000; i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        int k = (state >> 33) % 64;
+        if (live[k] != nullptr && (state & 3) == 0) {
+            live[k] = (char*)srealloc(live[k], 1 + (state >> 40) % (8 * KB));
+        } else {
+            sfree(live[k]);
+            live[k] = (char*)smalloc(1 + (state >> 40) % (state & 4 ? 300 * KB : 4 * KB));
+        }
+        assert(live[k] != nullptr);
+        if (i % 100 == 0) {
+            flush_quarantine();
+            check_counters();
+        }
+    }
+    for (int k = 0; k < 64; k++) {
+        sfree(live[k]);
+    }
+    flush_quarantine();
+    check_counters();
+}
+
+void test_sbrk_chunks() {
+    assert(smallopt(SMALLOPT_HEAP_BACKEND, HEAP_SBRK) == 1);
+    assert(smallopt(SMALLOPT_SBRK_CHUNK_MAX, 32 * KB) == 0);
+    assert(smallopt(SMALLOPT_SBRK_CHUNK_MIN, 2048 * KB) == 0);
+
+    // without chunks every block is an sbrk of its own
+    assert(smallopt(SMALLOPT_SBRK_CHUNK_MIN, 0) == 1);
+    char* start = (char*)sbrk(0);
+    size_t calls = _num_sbrk_calls();
+    for (int i = 0; i < 10; i++) {
+        assert(smalloc(100) != nullptr);
+    }
+    assert(_num_sbrk_calls() - calls == 10 && _num_sbrk_calls_saved() == 0);
+#ifndef SMALLOC_DEBUG
+    assert((size_t)((char*)sbrk(0) - start) == 10 * (104 + MD_SIZE));
+#endif
+
+    // with them a burst of small blocks takes one chunk, and the surplus saves the rest
+    assert(smallopt(SMALLOPT_SBRK_CHUNK_MIN, 64 * KB) == 1);
+    calls = _num_sbrk_calls();
+    for (int i = 0; i < 100; i++) {
+        assert(smalloc(100) != nullptr);
+    }
+    assert(_num_sbrk_calls() - calls == 1 && _num_sbrk_calls_saved() >= 99);
+
+    // the chunks double up to the max, 3MB takes a few calls instead of thousands
+    calls = _num_sbrk_calls();
+    start = (char*)sbrk(0);
+    for (int i = 0; i < 3000; i++) {
+        assert(smalloc(1000) != nullptr);
+    }
+    assert(_num_sbrk_calls() - calls <= 7);
+    assert((size_t)((char*)sbrk(0) - start) < 3000 * (1000 + MD_SIZE) + 1024 * KB);
+}
+
+void test_heap_segments() {
+    assert(smallopt(SMALLOPT_HEAP_BACKEND, HEAP_SEGMENTS) == 1);
+    assert(_num_heap_segments() == 0);
+
+    // blocks live in aligned segments, the break isn't touched
+    sbrk(4096);  // someone else's sbrk
+    char* brk = (char*)sbrk(0);
+    char* p = (char*)smalloc(100);
+    assert(p != nullptr && _num_heap_segments() == 1);
+    assert(segmentOf((MetaData*)p - 1) == (Segment*)((size_t)p & ~((size_t)SEGMENT_SIZE - 1)));
+    assert(smallopt(SMALLOPT_HEAP_BACKEND, HEAP_SBRK) == 0);
+
+    // a full segment is followed by another one
+    char* blocks[60];
+    for (int i = 0; i < 60; i++) {
+        blocks[i] = (char*)smalloc(100 * KB);
+        assert(blocks[i] != nullptr);
+        memset(blocks[i], i, 100 * KB);
+    }
+    assert(_num_heap_segments() == 2 && (char*)sbrk(0) == brk);
+
+    // a segment goes back once all its blocks are free
+    for (int i = 0; i < 60; i++) {
+        assert(blocks[i][100 * KB - 1] == (char)i);
+        sfree(blocks[i]);
+    }
+    flush_quarantine();
+    assert(_num_heap_segments() == 1);
+    sfree(p);
+    flush_quarantine();
+    assert(_num_heap_segments() == 0 && _num_allocated_blocks() == 0);
+}
+
+void test_mmap_threshold() {
+    assert(smallopt(SMALLOPT_HEAP_BACKEND, HEAP_SBRK) == 1);
+    assert(_mmap_threshold() == LARGE_ALLOC && _num_mmap_threshold_changes() == 0);
+
+    // a heap that can't grow lowers the threshold, and mmap serves the block
+    size_t page = getpagesize();
+    char* limit = (char*)(((size_t)sbrk(0) + page - 1) / page * page);
+    assert(mmap(limit, page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) == limit);
+    char* p = (char*)smalloc(120 * KB);
+    assert(p != nullptr && ((MetaData*)p - 1)->is_mmap);
+    assert(_mmap_threshold() == 64 * KB && _num_mmap_threshold_changes() == 1);
+    munmap(limit, page);
+
+    // a mapping freed right away raises it past its size
+    sfree(p);
+    assert(_mmap_threshold() > 120 * KB && _num_mmap_threshold_changes() == 2);
+    p = (char*)smalloc(200 * KB);
+    assert(((MetaData*)p - 1)->is_mmap);
+    sfree(p);
+    size_t raised = _mmap_threshold();
+    assert(raised > 200 * KB && _num_mmap_threshold_changes() == 3);
+    p = (char*)smalloc(200 * KB);
+    assert(!((MetaData*)p - 1)->is_mmap);
+    sfree(p);
+
+    // a long-lived one, or one as big as the maximum, doesn't
+    p = (char*)smalloc(300 * KB);
+    void* small[MMAP_SHORT_LIVED];
+    for (int i = 0; i < MMAP_SHORT_LIVED; i++) {
+        small[i] = smalloc(16);
+    }
+    sfree(p);
+    sfree(smalloc(MMAP_THRESHOLD_MAX));
+    assert(_mmap_threshold() == raised && _num_mmap_threshold_changes() == 3);
+
+    // smallopt fixes it, and 0 goes back to sliding from the default
+    assert(smallopt(SMALLOPT_MMAP_THRESHOLD, 64 * KB) == 1);
+    sfree(smalloc(100 * KB));
+    assert(_mmap_threshold() == 64 * KB);
+    assert(smallopt(SMALLOPT_MMAP_THRESHOLD, MMAP_THRESHOLD_MAX + 8) == 0);
+    assert(smallopt(SMALLOPT_MMAP_THRESHOLD, 8) == 0);
+    assert(smallopt(SMALLOPT_MMAP_THRESHOLD, MMAP_THRESHOLD_MIN - 8) == 0);
+    assert(_mmap_threshold() == 64 * KB);
+    assert(smallopt(SMALLOPT_MMAP_THRESHOLD, 0) == 1);
+    assert(_mmap_threshold() == LARGE_ALLOC);
+    for (int i = 0; i < MMAP_SHORT_LIVED; i++) {
+        sfree(small[i]);
+    }
+}
+
+void test_threads() {
+    size_t allocated = _num_allocated_blocks() - _num_free_blocks();
+    pthread_t threads[THREADS];
+
+    start_workers(threads);
+    usleep(200 * 1000);
+    join_workers(threads);
+    flush_quarantine();
+
+    // every worker gave back all its blocks
+    assert(_num_allocated_blocks() - _num_free_blocks() == allocated);
+}
+
+void test_fork_while_allocating() {
+    const int FORKS = 100;
+    pthread_t threads[THREADS];
+
+    start_workers(threads);
+    for (int i = 0; i < FORKS; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            // a deadlock in the child shows up as SIGALRM
+            alarm(5);
+            void* blocks[16];
+            for (int j = 0; j < 16; j++) {
+                blocks[j] = smalloc(j % 2 ? 100 : 300 * KB);
+                assert(blocks[j] != nullptr);
+            }
+            assert(smalloc_batch(64, 16, blocks) == 16);
+            sfree_batch(blocks, 16);
+            _exit(0);
+        }
+        assert(pid > 0);
+        int exit_status = 0;
+        waitpid(pid, &exit_status, 0);
+        assert(WIFEXITED(exit_status) && WEXITSTATUS(exit_status) == 0);
+    }
+    join_workers(threads);
+}
+
+void* reentry_result = (void*)1;
+
+void reentry_handler(int) {
+    reentry_result = smalloc(100);
+}
+
+void storm_handler(int) {
+    sfree(smalloc(100));
+}
+
+volatile bool storm_over = false;
+
+void* storm_sender(void* arg) {
+    pthread_t target = *(pthread_t*)arg;
+    for (int i = 0; i < 20000; i++) {
+        pthread_kill(target, SIGUSR2);
+        if (i % 16 == 0) sched_yield();
+    }
+    storm_over = true;
+    return nullptr;
+}
+
+void test_signal_reentry() {
+    signal(SIGUSR1, reentry_handler);
+    {
+        // the signal arrives while this thread is inside the allocator
+        HeapLock lock;
+        raise(SIGUSR1);
+    }
+    assert(reentry_result == nullptr);
+
+    // and outside of it the handler allocates as usual
+    raise(SIGUSR1);
+    assert(reentry_result != nullptr);
+    sfree(reentry_result);
+
+    // signals that land anywhere, right before or after the mutex included, never
+    // deadlock: a hang shows up as SIGALRM
+    signal(SIGUSR2, storm_handler);
+    alarm(20);
+    pthread_t self = pthread_self(), sender;
+    assert(pthread_create(&sender, nullptr, storm_sender, &self) == 0);
+    while (!storm_over) {
+        sfree(smalloc(64));
+    }
+    pthread_join(sender, nullptr);
+    alarm(0);
+}
+
+void* node_worker(void* arg) {
+    // allocates on the node given by arg, and frees what the main thread allocated
+    void** blocks = (void**)arg;
+    smalloc_bind_node(1);
+    sfree(blocks[0]);
+    blocks[1] = smalloc(64 * KB);
+    return nullptr;
+}
+
+void test_numa_arenas() {
+    // two simulated nodes on whatever machine runs the test
+    assert(smallopt(SMALLOPT_HEAP_BACKEND, HEAP_SEGMENTS));
+    assert(smallopt(SMALLOPT_NUMA_NODES, 2));
+    assert(_num_numa_nodes() == 2);
+
+    assert(smalloc_bind_node(0));
+    void* blocks[2] = {smalloc(64 * KB), nullptr};
+    assert(blocks[0] != nullptr);
+    assert(_num_node_segments(0) == 1 && _num_node_segments(1) == 0);
+
+    pthread_t thread;
+    assert(pthread_create(&thread, nullptr, node_worker, blocks) == 0);
+    pthread_join(thread, nullptr);
+    flush_quarantine();
+
+    // the block freed by the worker went back to node 0, the new one came from node 1
+    assert(_num_node_segments(1) == 1);
+    assert(segmentOf((MetaData*)blocks[1] - 1)->arena == &arenas[1]);
+    assert(_num_node_free_bytes(0) == _num_node_bytes(0) && _num_node_segments(0) == 0);
+    assert(_num_node_bytes(1) + _num_node_bytes(0) == _num_allocated_bytes());
+
+    // the heap can't be split again once it has blocks
+    assert(!smallopt(SMALLOPT_NUMA_NODES, 4));
+    sfree(blocks[1]);
+    flush_quarantine();
+    assert(_num_node_segments(1) == 0 && _num_allocated_blocks() == 0);
+}
+
+void test_numa_node_policy() {
+    // node 0 always exists, its segments prefer its memory
+    assert(smallopt(SMALLOPT_HEAP_BACKEND, HEAP_SEGMENTS));
+    assert(smalloc_bind_node(0));
+    void* p = smalloc(100);
+    assert(p != nullptr);
+
+    int mode = -1;
+    unsigned long mask = 0;
+    assert(syscall(SYS_get_mempolicy, &mode, &mask, 8 * sizeof(mask), p, MPOL_F_ADDR) == 0);
+    assert(mode == MPOL_PREFERRED && mask == 1);
+    sfree(p);
+}
+
+void test_stl_allocators() {
+    size_t allocated = _num_allocated_blocks() - _num_free_blocks();
+
+    {
+        std::vector<int, SmallocAllocator<int>> vector;
+        for (int i = 0; i < 100000; i++) {
+            vector.push_back(i);
+        }
+        assert(vector[99999] == 99999);
+
+        SmallocAllocator<long> allocator;
+        long* array = allocator.allocate(10);
+        array[9] = 9;
+        array = allocator.reallocate(array, 10, 100000);
+        assert(array[9] == 9);
+        allocator.deallocate(array, 100000);
+
+        // over-aligned blocks come from the pmr resource
+        void* aligned = smalloc_resource()->allocate(100, 64);
+        assert((size_t)aligned % 64 == 0);
+        smalloc_resource()->deallocate(aligned, 100, 64);
+
+        // 0 bytes are a block like any other
+        void* empty = smalloc_resource()->allocate(0, 8);
+        assert(empty != nullptr);
+        smalloc_resource()->deallocate(empty, 0, 8);
+        long* none = allocator.allocate(0);
+        assert(none != nullptr);
+        none = allocator.reallocate(none, 0, 0);
+        assert(none != nullptr);
+        allocator.deallocate(none, 0);
+    }
+
+    {
+        SmallocPoolResource pool(64);
+        std::pmr::map<int, int> map(&pool);
+        std::pmr::list<int> list(&pool);
+        for (int i = 0; i < 1000; i++) {
+            map[i] = i;
+            list.push_back(i);
+        }
+        assert(map.size() == 1000 && list.back() == 999);
+        for (int i = 0; i < 1000; i += 2) {
+            map.erase(i);
+        }
+        assert(map.size() == 500 && map.begin()->first == 1);
+    }
+    flush_quarantine();
+
+    // the containers and the pool gave every block back
+    assert(_num_allocated_blocks() - _num_free_blocks() == allocated);
+}
+
+void* fixed_worker(void*) {
+    void* blocks[100];
+    for (int i = 0; i < 100; i++) {
+        blocks[i] = smalloc_fixed<40>();
+    }
+    for (int i = 0; i < 100; i++) {
+        sfree_fixed<40>(blocks[i]);
+    }
+    return nullptr;
+}
+
+void test_fixed_sizes() {
+#ifdef FIXED_RSEQ
+    fixed_per_cpu = false; // the thread lists, the CPU lists are tested below
+#endif
+    size_t allocated = _num_allocated_blocks() - _num_free_blocks();
+    static_assert(fixedSize(13) == 16 && fixedSize(16) == 16, "sizes are aligned to 8");
+#ifndef SMALLOC_DEBUG
+    static_assert(fixedPath(FIXED_CACHE_MAX) == FIXED_CACHE, "small sizes are cached");
+#endif
+    static_assert(fixedPath(FIXED_CACHE_MAX + 1) == FIXED_HEAP, "bigger ones go to smalloc");
+
+    // 13 and 16 bytes share a class, and the blocks are plain smalloc blocks
+    void* blocks[1000];
+    for (int i = 0; i < 1000; i++) {
+        blocks[i] = i % 2 ? smalloc_fixed<13>() : smalloc_fixed<16>();
+        assert(blocks[i] != nullptr && smalloc_usable_size(blocks[i]) >= 13);
+        memset(blocks[i], i, 13);
+    }
+    for (int i = 0; i < 1000; i++) {
+        assert(((unsigned char*)blocks[i])[12] == (unsigned char)i);
+        if (i % 3) sfree_fixed<16>(blocks[i]);
+        else sfree(blocks[i]);
+    }
+#ifndef SMALLOC_DEBUG
+    assert(FixedClass<16>::cache.count <= FIXED_CACHED_MAX);
+
+    // a signal handler that interrupts the thread's list leaves it alone
+    size_t cached = FixedClass<16>::cache.count;
+    FixedClass<16>::cache.busy = true;
+    void* handled = smalloc_fixed<16>();
+    assert(handled != nullptr && FixedClass<16>::cache.count == cached);
+    sfree_fixed<16>(handled);
+    assert(FixedClass<16>::cache.count == cached);
+    FixedClass<16>::cache.busy = false;
+#endif
+
+    void* large = smalloc_fixed<300 * KB>();
+    assert(large != nullptr && ((MetaData*)large - 1)->is_mmap);
+    sfree_fixed<300 * KB>(large);
+
+    // a thread gives its caches back when it exits
+    pthread_t thread;
+    assert(pthread_create(&thread, nullptr, fixed_worker, nullptr) == 0);
+    pthread_join(thread, nullptr);
+
+    FixedClass<16>::cache.drain(0);
+    flush_quarantine();
+    assert(_num_allocated_blocks() - _num_free_blocks() == allocated);
+}
+
+void test_fixed_per_cpu() {
+#ifdef FIXED_RSEQ
+    if (!fixed_per_cpu) return; // rseq isn't registered, test_fixed_sizes covers the thread lists
+
+    // stay on one CPU, so every block goes through its list
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(sched_getcpu(), &cpus);
+    assert(sched_setaffinity(0, sizeof(cpus), &cpus) == 0);
+    size_t allocated = _num_allocated_blocks() - _num_free_blocks();
+
+    void* blocks[1000];
+    for (int i = 0; i < 1000; i++) {
+        blocks[i] = smalloc_fixed<40>();
+        assert(blocks[i] != nullptr && smalloc_usable_size(blocks[i]) >= 40);
+        memset(blocks[i], i, 40);
+    }
+    FixedCpuList* list = &FixedClass<40>::cpu_lists.load()[sched_getcpu()];
+    for (int i = 0; i < 1000; i++) {
+        assert(((unsigned char*)blocks[i])[39] == (unsigned char)i);
+        sfree_fixed<40>(blocks[i]);
+    }
+    assert(list->top > 0 && list->top <= FIXED_SLOTS);
+    assert(FixedClass<40>::cache.count == 0);
+
+    // threads share the CPU's list instead of keeping a cache each
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&threads[i], nullptr, fixed_worker, nullptr) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+    assert(list->top <= FIXED_SLOTS);
+    assert(_num_allocated_blocks() - _num_free_blocks() == allocated + list->top);
+#endif
+}
+
+void test_stream_copy() {
+    // a threshold below 1KB is refused
+    assert(smallopt(SMALLOPT_STREAM_THRESHOLD, 8) == 0);
+    assert(smallopt(SMALLOPT_STREAM_THRESHOLD, KB - 1) == 0);
+
+    // the kernels themselves copy and zero a few bytes plainly, whatever the alignment
+    if (stream_copy == nullptr) initCopyKernels();
+    char small_src[300], small_dst[300];
+    for (size_t i = 0; i < sizeof(small_src); i++) {
+        small_src[i] = (char)(i + 1);
+    }
+    for (size_t n = 0; n <= 260; n += 13) {
+        memset(small_dst, 'x', sizeof(small_dst));
+        stream_copy(small_dst + 3, small_src, n);
+        assert(memcmp(small_dst + 3, small_src, n) == 0 && small_dst[3 + n] == 'x');
+        memset(small_dst, 'x', sizeof(small_dst));
+        stream_zero(small_dst + 1, n);
+        assert(small_dst[1 + n] == 'x' && (n == 0 || small_dst[n] == 0));
+    }
+
+    // stream everything from 1KB up, so the vector kernels do the work
+    assert(smallopt(SMALLOPT_STREAM_THRESHOLD, KB) == 1);
+
+    // scalloc over a reused heap block must still come back zeroed
+    char* dirty = (char*)smalloc(60 * KB + 3);
+    assert(dirty != nullptr && !((MetaData*)dirty - 1)->is_mmap);
+    memset(dirty, 0xAB, 60 * KB + 3);
+    sfree(dirty);
+    flush_quarantine();
+    char* zeroed = (char*)scalloc(1, 60 * KB + 3);
+    assert(zeroed != nullptr);
+    for (size_t i = 0; i < 60 * KB + 3; i++) {
+        assert(zeroed[i] == 0);
+    }
+
+    // an odd-sized block moved by srealloc keeps every byte, unaligned head and tail included
+    char* p = (char*)smalloc(20 * KB + 5);
+    void* pin = smalloc(16);
+    assert(p != nullptr && pin != nullptr);
+    for (size_t i = 0; i < 20 * KB + 5; i++) {
+        p[i] = (char)(i * 7);
+    }
+    char* moved = (char*)srealloc(p, 90 * KB + 1);
+    assert(moved != nullptr && moved != p);
+    for (size_t i = 0; i < 20 * KB + 5; i++) {
+        assert(moved[i] == (char)(i * 7));
+    }
+
+    assert(smallopt(SMALLOPT_STREAM_THRESHOLD, 0) == 1);
+    assert(stream_threshold >= KB);
+    sfree(moved);
+    sfree(pin);
+    sfree(zeroed);
+}
+
+void test_growing_blocks() {
+    // a buffer grown 100 bytes at a time, with a pinned block after every step so
+    // most growths can't merge in place
+    const int STEPS = 1000;
+    static void* pins[STEPS];
+#ifndef SMALLOC_DEBUG
+    size_t copied = _num_realloc_copied_bytes();
+#endif
+    char* buffer = nullptr;
+    for (int i = 1; i <= STEPS; i++) {
+        buffer = (char*)srealloc(buffer, i * 100);
+        assert(buffer != nullptr);
+        buffer[i * 100 - 1] = (char)i;
+        pins[i - 1] = smalloc(16);
+    }
+    for (int i = 1; i <= STEPS; i++) {
+        assert(buffer[i * 100 - 1] == (char)i);
+    }
+#ifndef SMALLOC_DEBUG
+    // without the reserve this would be the sum of all the sizes, about 50MB
+    assert(_num_realloc_copied_bytes() - copied < 4 * STEPS * 100);
+    assert(smalloc_usable_size(buffer) >= STEPS * 100);
+
+    // a small shrink keeps the reserve, a big one gives it back
+    assert(srealloc(buffer, STEPS * 90) == buffer);
+    assert(srealloc(buffer, KB) == buffer);
+    assert(smalloc_usable_size(buffer) < KB + 128 + _size_meta_data());
+    assert(((MetaData*)buffer - 1)->grows == 0);
+#endif
+
+    for (int i = 0; i < STEPS; i++) {
+        sfree(pins[i]);
+    }
+    sfree(buffer);
+}
+
+void test_shrinking_blocks() {
+#ifndef SMALLOC_DEBUG
+    // a mapping shrinks in place, its tail pages are unmapped
+    char* mapped = (char*)smalloc(1024 * KB);
+    assert(mapped != nullptr && ((MetaData*)mapped - 1)->is_mmap);
+    memset(mapped, 'm', 1024 * KB);
+    size_t allocated = _num_allocated_bytes();
+    assert(srealloc(mapped, 200 * KB) == mapped);
+    assert(_num_allocated_bytes() == allocated - 824 * KB);
+    assert(mapped[200 * KB - 1] == 'm');
+    // too small to keep a mapping for, it moves to the heap
+    char* moved = (char*)srealloc(mapped, KB);
+    assert(moved != mapped && !((MetaData*)moved - 1)->is_mmap && moved[KB - 1] == 'm');
+
+    // a big heap block gives its tail back to the histogram and its pages to the kernel
+    assert(smallopt(SMALLOPT_MMAP_THRESHOLD, 2048 * KB) == 1);
+    char* big = (char*)smalloc(1024 * KB);
+    void* pin = smalloc(16);
+    assert(big != nullptr && !((MetaData*)big - 1)->is_mmap);
+    memset(big, 'h', 1024 * KB);
+    size_t purged = _num_purged_bytes();
+    size_t free_bytes = _num_free_bytes();
+    assert(srealloc(big, 100 * KB) == big);
+    assert(_num_purged_bytes() - purged > 900 * KB);
+    assert(_num_free_bytes() > free_bytes + 900 * KB);
+    assert(big[100 * KB - 1] == 'h');
+
+    // a tail too small to split off joins the free block after it
+    char* a = (char*)smalloc(1000);
+    char* b = (char*)smalloc(1000);
+    void* pin2 = smalloc(16);
+    sfree(b);
+    free_bytes = _num_free_bytes();
+    size_t free_blocks = _num_free_blocks();
+    assert(srealloc(a, 960) == a);
+    assert(_num_free_bytes() == free_bytes + 40 && _num_free_blocks() == free_blocks);
+    assert(nextBlock((MetaData*)a - 1)->is_free);
+
+    sfree(moved);
+    sfree(big);
+    sfree(pin);
+    sfree(a);
+    sfree(pin2);
+#endif
+}
+
+void test_deferred_coalescing() {
+#ifndef SMALLOC_DEBUG
+    // exact sbrk sizes, so no chunk surplus can serve the requests below
+    assert(smallopt(SMALLOPT_SBRK_CHUNK_MIN, 0) == 1);
+    assert(smallopt(SMALLOPT_DEFERRED_COALESCING, 2) == 0);
+    assert(smallopt(SMALLOPT_DEFERRED_COALESCING, 1) == 1);
+
+    // a freed block is counted as free, and the next request of its size takes it back
+    void* p = smalloc(64);
+    void* pin = smalloc(16);
+    size_t free_blocks = _num_free_blocks();
+    sfree(p);
+    sfree(p);
+    assert(_num_free_blocks() == free_blocks + 1 && ((MetaData*)p - 1)->is_deferred);
+    assert(smalloc(64) == p);
+    assert(_num_free_blocks() == free_blocks);
+
+    // a request that misses merges the deferred blocks before the heap grows
+    // (a segment has free space left over, so only the sbrk heap misses here)
+    void* blocks[8];
+    for (int i = 0; i < 8; i++) {
+        blocks[i] = smalloc(128);
+    }
+    void* pin2 = smalloc(16);
+    for (int i = 0; i < 8; i++) {
+        sfree(blocks[i]);
+    }
+    void* heap_end = sbrk(0);
+    void* merged = smalloc(900);
+    if (heap_backend == HEAP_SBRK) {
+        assert(merged == blocks[0] && sbrk(0) == heap_end);
+    }
+
+    // so does a full cache, filled from empty
+    assert(smallopt(SMALLOPT_DEFERRED_COALESCING, 0) == 1);
+    assert(smallopt(SMALLOPT_DEFERRED_COALESCING, 1) == 1);
+    static void* many[DEFER_BLOCKS + 1];
+    for (int i = 0; i <= DEFER_BLOCKS; i++) {
+        many[i] = smalloc(200);
+    }
+    void* pin3 = smalloc(16);
+    free_blocks = _num_free_blocks();
+    for (int i = 0; i <= DEFER_BLOCKS; i++) {
+        sfree(many[i]);
+    }
+    assert(arena->deferred_count == 0);
+    assert(_num_free_blocks() <= free_blocks + 2);
+
+    // turning it off merges what was left
+    sfree(pin3);
+    assert(arena->deferred_count == 1);
+    assert(smallopt(SMALLOPT_DEFERRED_COALESCING, 0) == 1);
+    assert(arena->deferred_count == 0 && ((MetaData*)pin3 - 1)->is_free);
+    sfree(merged);
+    sfree(pin);
+    sfree(pin2);
+#endif
+}
+
+/* Polls for up to a second, the maintenance thread works on its own schedule. */
+bool eventually(bool (*condition)()) {
+    for (int i = 0; i < 1000 && !condition(); i++) {
+        usleep(1000);
+    }
+    return condition();
+}
+
+void test_maintenance_thread() {
+    assert(smallopt(SMALLOPT_HEAP_BACKEND, HEAP_SBRK) == 1);
+    assert(smallopt(SMALLOPT_MMAP_THRESHOLD, 2048 * KB) == 1);
+    assert(smalloc_maintenance_start(0) == 0);
+    assert(smalloc_maintenance_stop() == 0);
+    assert(smalloc_maintenance_start(10) == 1);
+
+    // a free wilderness is trimmed, a block that stays free gets its pages purged
+    char* middle = (char*)smalloc(1024 * KB);
+    void* pin = smalloc(16);
+    char* tail[8];
+    for (int i = 0; i < 8; i++) {
+        tail[i] = (char*)smalloc(1024 * KB);
+        memset(tail[i], 't', 1024 * KB);
+    }
+    memset(middle, 'm', 1024 * KB);
+    void* heap_end = sbrk(0);
+    for (int i = 0; i < 8; i++) {
+        sfree(tail[i]);
+    }
+    sfree(middle);
+    flush_quarantine();
+    assert(eventually([] { return _num_trimmed_bytes() >= 7 * 1024 * KB; }));
+    assert((char*)heap_end - (char*)sbrk(0) == (long)_num_trimmed_bytes());
+    assert(eventually([] { return _num_purged_bytes() > 900 * KB; }));
+    assert(_num_maintenance_steps() > 0);
+
+    // the purged block is reused as usual, and the trimmed heap grows again
+    char* again = (char*)smalloc(1024 * KB);
+    assert(again == middle);
+    memset(again, 'a', 1024 * KB);
+    char* grown = (char*)smalloc(1024 * KB);
+    assert(grown != nullptr);
+    memset(grown, 'g', 1024 * KB);
+
+    // however many big blocks are free, every one of them is purged in the end
+    static void* blocks[600];
+    static void* pins[600];
+    for (int i = 0; i < 600; i++) {
+        blocks[i] = smalloc(70 * KB);
+        pins[i] = smalloc(16);
+        assert(blocks[i] != nullptr && pins[i] != nullptr);
+        memset(blocks[i], 'b', 70 * KB);
+    }
+    static size_t purged;
+    purged = _num_purged_bytes();
+    for (int i = 0; i < 600; i++) {
+        sfree(blocks[i]);
+    }
+    flush_quarantine();
+    assert(eventually([] { return _num_purged_bytes() - purged >= 600 * 64 * KB; }));
+    for (int i = 0; i < 600; i++) {
+        sfree(pins[i]);
+    }
+    flush_quarantine();
+
+    // a deferred cache filling up is merged before a request has to
+    assert(smallopt(SMALLOPT_DEFERRED_COALESCING, 1) == 1);
+    static void* small[DEFER_BLOCKS / 2];
+    for (int i = 0; i < DEFER_BLOCKS / 2; i++) {
+        small[i] = smalloc(64);
+    }
+    for (int i = 0; i < DEFER_BLOCKS / 2; i++) {
+        sfree(small[i]);
+    }
+    flush_quarantine();
+    assert(eventually([] { HeapLock lock; return arenas[0].deferred_count == 0; }));
+
+    // a fork child has no thread, until it starts its own
+    pid_t pid = fork();
+    if (pid == 0) {
+        assert(smalloc_maintenance_stop() == 0);
+        void* p = smalloc(100);
+        assert(p != nullptr);
+        sfree(p);
+        assert(smalloc_maintenance_start(10) == 1);
+        assert(smalloc_maintenance_stop() == 1);
+        exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    assert(status == 0);
+
+    assert(smalloc_maintenance_stop() == 1);
+    assert(smalloc_maintenance_stop() == 0);
+    sfree(again);
+    sfree(grown);
+    sfree(pin);
+}
+
+void test_overflow_and_move() {
+    // an overflowing scalloc fails
+    assert(scalloc((size_t)1 << 40, (size_t)1 << 40) == nullptr);
+    assert(scalloc(MAX_SIZE / 8 + 1, 8) == nullptr);
+    assert(scalloc(0, 8) == nullptr && scalloc(8, 0) == nullptr);
+
+    // and a block srealloc moves away merges with the free blocks on both sides
+    assert(smallopt(SMALLOPT_HEAP_BACKEND, HEAP_SBRK) == 1);
+    char* a = (char*)smalloc(KB);
+    char* b = (char*)smalloc(KB);
+    char* c = (char*)smalloc(KB);
+    char* pin = (char*)smalloc(16);
+    sfree(a);
+    sfree(c);
+    char* moved = (char*)srealloc(b, 10 * KB);
+    assert(moved != nullptr && moved != b && moved != a);
+    flush_quarantine();
+    MetaData* merged = (MetaData*)a - 1;
+    assert(merged->is_free && nextBlock(merged) == (MetaData*)pin - 1);
+    check_counters();
+    sfree(moved);
+    sfree(pin);
+}
+
+/* Writes 'content' to root + name, the fake sysfs of the pressure tests. */
+void write_fake_file(const std::string& root, const char* name, const char* content) {
+    FILE* file = fopen((root + name).c_str(), "w");
+    assert(file != nullptr);
+    fputs(content, file);
+    fclose(file);
+}
+
+void fake_pressure(const std::string& root, const char* current, const char* psi) {
+    write_fake_file(root, "/sys/fs/cgroup/memory.current", current);
+    write_fake_file(root, "/proc/pressure/memory", psi);
+}
+
+void test_memory_pressure() {
+    assert(smallopt(SMALLOPT_HEAP_BACKEND, HEAP_SBRK) == 1);
+    char dir[] = "/tmp/smalloc_sysfs_XXXXXX";
+    assert(mkdtemp(dir) != nullptr);
+    std::string root = dir;
+    for (const char* sub : {"/sys", "/sys/fs", "/sys/fs/cgroup", "/proc", "/proc/pressure"}) {
+        assert(mkdir((root + sub).c_str(), 0700) == 0);
+    }
+    assert(smalloc_pressure_root(root.c_str()) == 1);
+
+    // no files, or no limit and no stalls, is no pressure
+    assert(smalloc_pressure_check() == 0);
+    write_fake_file(root, "/sys/fs/cgroup/memory.max", "max\n");
+    fake_pressure(root, "990000\n", "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+    assert(smalloc_pressure_check() == 0);
+
+    // a free block in the middle of the heap, and a free wilderness
+    char* middle[8];
+    for (int i = 0; i < 8; i++) {
+        middle[i] = (char*)smalloc(100 * KB);
+        memset(middle[i], 'm', 100 * KB);
+    }
+    void* pin = smalloc(16);
+    char* tail[8];
+    for (int i = 0; i < 8; i++) {
+        tail[i] = (char*)smalloc(100 * KB);
+        memset(tail[i], 't', 100 * KB);
+    }
+    // and many more apart from each other
+    static char* spread[300];
+    static void* pins[300];
+    for (int i = 0; i < 300; i++) {
+        spread[i] = (char*)smalloc(70 * KB);
+        pins[i] = smalloc(16);
+        memset(spread[i], 's', 70 * KB);
+    }
+    for (int i = 0; i < 8; i++) {
+        sfree(middle[i]);
+        sfree(tail[i]);
+    }
+    for (int i = 0; i < 300; i++) {
+        sfree(spread[i]);
+    }
+    flush_quarantine();
+    size_t purged = _num_purged_bytes();
+    size_t trimmed = _num_trimmed_bytes();
+
+#ifndef SMALLOC_DEBUG
+    // and a thread list of fixed size blocks
+#ifdef FIXED_RSEQ
+    fixed_per_cpu = false;
+#endif
+    void* fixed[64];
+    for (int i = 0; i < 64; i++) {
+        fixed[i] = smalloc_fixed<16>();
+    }
+    for (int i = 0; i < 64; i++) {
+        sfree_fixed<16>(fixed[i]);
+    }
+    assert(FixedClass<16>::cache.count >= 64);
+#endif
+
+    // 95% of the limit: the free memory goes back, and large blocks are mapped sooner
+    write_fake_file(root, "/sys/fs/cgroup/memory.max", "1000000\n");
+    fake_pressure(root, "950000\n", "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+    assert(smalloc_pressure_check() == 1);
+    assert(_num_pressure_events() == 1 && _mmap_threshold() == 64 * KB);
+    assert(_num_purged_bytes() - purged > 700 * KB + 300 * 64 * KB);
+    assert(_num_trimmed_bytes() - trimmed > 700 * KB);
+#ifndef SMALLOC_DEBUG
+    // the thread drains its list on its next sfree_fixed
+    sfree_fixed<16>(smalloc_fixed<16>());
+    assert(FixedClass<16>::cache.count == 1);
+#endif
+    assert(smalloc_pressure_check() == 1);
+    assert(_num_pressure_events() == 1 && _mmap_threshold() == 32 * KB);
+
+    // the purged block is reused as usual, bigger blocks are mapped now
+    char* again = (char*)smalloc(20 * KB);
+    bool reused = false;
+    for (int i = 0; i < 300; i++) {
+        reused = reused || (again >= spread[i] && again < spread[i] + 70 * KB);
+    }
+    assert(reused);
+    memset(again, 'a', 20 * KB);
+    char* mapped = (char*)smalloc(100 * KB);
+    assert(mapped != nullptr && (mapped < again || mapped > (char*)sbrk(0)));
+    sfree(mapped);
+
+    // it lasts until usage and stalls are well under the thresholds
+    fake_pressure(root, "850000\n", "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+    assert(smalloc_pressure_check() == 1);
+    fake_pressure(root, "500000\n", "some avg10=12.50 avg60=3.00 avg300=1.00 total=9000\n");
+    assert(smalloc_pressure_check() == 1);
+    fake_pressure(root, "500000\n", "some avg10=3.00 avg60=3.00 avg300=1.00 total=9000\n"
+                                     "full avg10=2.00 avg60=1.00 avg300=0.50 total=5000\n");
+    assert(smalloc_pressure_check() == 0);
+    assert(_mmap_threshold() == LARGE_ALLOC && _num_pressure_events() == 1);
+
+    // the thresholds are tunable, 0 ignores a signal
+    assert(smallopt(SMALLOPT_PRESSURE_USAGE, 101) == 0);
+    assert(smallopt(SMALLOPT_PRESSURE_PSI, 200) == 1);
+    assert(smalloc_pressure_check() == 1 && _num_pressure_events() == 2);
+    assert(smallopt(SMALLOPT_PRESSURE_PSI, 0) == 1);
+    assert(smallopt(SMALLOPT_PRESSURE_USAGE, 40) == 1);
+    assert(smalloc_pressure_check() == 1);
+    assert(smallopt(SMALLOPT_PRESSURE_USAGE, 0) == 1);
+    assert(smalloc_pressure_check() == 0);
+
+    // the maintenance thread checks every interval, the root can't change meanwhile
+    assert(smallopt(SMALLOPT_PRESSURE_USAGE, 90) == 1);
+    assert(smalloc_maintenance_start(10) == 1);
+    assert(smalloc_pressure_root(nullptr) == 0);
+    fake_pressure(root, "990000\n", "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+    assert(eventually([] { return _num_pressure_events() == 3; }));
+    assert(smalloc_maintenance_stop() == 1);
+    assert(smalloc_pressure_root(nullptr) == 1);
+
+    sfree(again);
+    sfree(pin);
+    for (int i = 0; i < 300; i++) {
+        sfree(pins[i]);
+    }
+    for (const char* name : {"/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory.current",
+                             "/proc/pressure/memory"}) {
+        unlink((root + name).c_str());
+    }
+    for (const char* sub : {"/sys/fs/cgroup", "/sys/fs", "/sys", "/proc/pressure", "/proc", ""}) {
+        rmdir((root + sub).c_str());
+    }
+}
+
+void test_page_map() {
+#ifndef SMALLOC_DEBUG
+    // pointers that aren't blocks of ours are counted and left alone
+    static size_t not_ours[4];
+    size_t on_stack[4];
+    void* from_malloc = malloc(100);
+    char* small = (char*)smalloc(100);
+    char* mapped = (char*)smalloc(1024 * KB);
+    assert(((MetaData*)mapped - 1)->is_mmap);
+    size_t allocated = _num_allocated_blocks(), free_blocks = _num_free_blocks();
+
+    sfree(&not_ours[2]);
+    sfree(&on_stack[2]);
+    sfree(small + 4);
+    sfree(mapped + 64);
+    sfree_sized(&not_ours[2], 8);
+    assert(srealloc(&on_stack[2], 200) == nullptr);
+    assert(smalloc_usable_size(mapped + 8) == 0 && smalloc_usable_size(small) >= 100);
+    void* batch[2] = {&not_ours[2], from_malloc};
+    sfree_batch(batch, 2);
+    assert(_num_invalid_frees() == 8);
+    assert(_num_allocated_blocks() == allocated && _num_free_blocks() == free_blocks);
+    free(from_malloc);
+
+    // a block is found from any of its pages, and forgotten once it is gone
+    assert(pageOwner(pageEntry(mapped + 1000 * KB)) == (MetaData*)mapped - 1);
+    assert(pageKind(pageEntry(small)) != PAGE_NONE);
+    assert(_num_pagemap_bytes() > 0);
+    sfree(mapped);
+    assert(pageEntry(mapped) == 0);
+    sfree(mapped);
+    assert(_num_invalid_frees() == 9);
+
+    // so are pointers into the middle of a heap block, and headers merged away
+    char* block = (char*)smalloc(1000);
+    char* next = (char*)smalloc(1000);
+    assert(next == block + 1000 + MD_SIZE);
+    allocated = _num_allocated_blocks();
+    free_blocks = _num_free_blocks();
+    sfree(block + 512);
+    assert(srealloc(block + 512, 2000) == nullptr && smalloc_usable_size(block + 512) == 0);
+    assert(_num_invalid_frees() == 11);
+    assert(_num_allocated_blocks() == allocated && _num_free_blocks() == free_blocks);
+    sfree(next);
+    sfree(block);
+    allocated = _num_allocated_blocks();
+    sfree(next);
+    assert(_num_invalid_frees() == 12 && _num_allocated_blocks() == allocated);
+
+    // the kinds of the backends
+    void* heap_block = smalloc(64 * KB);
+    PageKind kind = pageKind(pageEntry(heap_block));
+    assert(kind == (heap_backend == HEAP_SBRK ? PAGE_HEAP : PAGE_SEGMENT));
+    sfree(heap_block);
+    sfree(small);
+    assert(_num_invalid_frees() == 12);
+#endif
+}
+
+struct PersistNode {
+    PersistNode* next;
+    int value;
+};
+
+int persist_sum() {
+    int sum = 0;
+    for (PersistNode* node = (PersistNode*)spersist_get_root(); node != nullptr; node = node->next) {
+        sum += node->value;
+    }
+    return sum;
+}
+
+volatile bool persist_worker_filled = false;
+
+/* Fills its list of 64 byte blocks from the persistent heap, and exits once it is closed. */
+void* persist_fixed_worker(void*) {
+    sfree_fixed<64>(smalloc_fixed<64>());
+    persist_worker_filled = true;
+    while (persist_worker_filled) {
+        sched_yield();
+    }
+    return nullptr;
+}
+
+void test_persistent_heap() {
+    char path[] = "/tmp/smalloc_persist_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    // an empty file is a new heap, every block comes from it, even a large one
+    assert(smallopt(SMALLOPT_HEAP_BACKEND, HEAP_SBRK) == 1);
+    assert(spersist_open(path, 16 * 1024 * KB) == 0);
+    assert(spersist_open(path, 16 * 1024 * KB) == -1);
+    PersistNode* head = nullptr;
+    for (int i = 1; i <= 1000; i++) {
+        PersistNode* node = (PersistNode*)smalloc(sizeof(PersistNode));
+        node->next = head;
+        node->value = i;
+        head = node;
+    }
+    void* large = smalloc(1024 * KB);
+    assert(large != nullptr && !((MetaData*)large - 1)->is_mmap);
+    sfree(large);
+    spersist_set_root(head);
+    flush_quarantine();
+    size_t blocks = _num_allocated_blocks() - _num_free_blocks();
+    assert(spersist_close() == 0);
+    assert(spersist_get_root() == nullptr && _num_allocated_blocks() == 0);
+
+#ifndef SMALLOC_DEBUG
+    // meanwhile the process counts a bad free
+    int local = 0;
+    sfree(&local);
+    size_t invalid = _num_invalid_frees();
+    assert(invalid > 0);
+#endif
+
+    // reopened, the blocks and the root are where they were, the process counters go on
+    assert(spersist_open(path, 0) == 1);
+    assert(_num_allocated_blocks() - _num_free_blocks() == blocks);
+#ifndef SMALLOC_DEBUG
+    assert(_num_invalid_frees() == invalid);
+#endif
+    assert(persist_sum() == 500500);
+
+    // a fork child works on its own copy, the file doesn't see its changes
+    pid_t pid = fork();
+    if (pid == 0) {
+        ((PersistNode*)spersist_get_root())->value = 0;
+        sfree(smalloc(100));
+        assert(spersist_close() == -1);
+        exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    assert(status == 0 && persist_sum() == 500500);
+
+    head = (PersistNode*)spersist_get_root();
+    spersist_set_root(head->next);
+    sfree(head);
+#ifndef SMALLOC_DEBUG
+    // the start map of the reopened blocks was rebuilt
+    assert(_num_invalid_frees() == invalid);
+#endif
+    assert(spersist_close() == 0);
+
+    // a heap that was not closed is refused
+    pid = fork();
+    if (pid == 0) {
+        assert(spersist_open(path, 0) == 1 && persist_sum() == 500500 - 1000);
+        exit(0);
+    }
+    waitpid(pid, &status, 0);
+    assert(status == 0);
+    assert(spersist_open(path, 0) == -1);
+
+    // and the process is back on the sbrk heap
+    void* p = smalloc(100);
+    assert(p != nullptr && (char*)p < PERSIST_BASE);
+    sfree(p);
+    unlink(path);
+}
+
+/* The persistent heap under smalloc_fixed's lists (per CPU or per thread) and a pool. */
+void persist_caches(const char* path, bool per_cpu) {
+#ifdef FIXED_RSEQ
+    fixed_per_cpu = fixed_per_cpu && per_cpu;
+#else
+    (void)per_cpu;
+#endif
+    assert(smallopt(SMALLOPT_HEAP_BACKEND, HEAP_SBRK) == 1);
+    assert(spersist_open(path, 16 * 1024 * KB) == 0);
+    SmallocPoolResource pool(24);
+    sfree_fixed<64>(smalloc_fixed<64>());
+    pool.deallocate(pool.allocate(24), 24);
+    pthread_t thread;
+    assert(pthread_create(&thread, nullptr, persist_fixed_worker, nullptr) == 0);
+    while (!persist_worker_filled) {
+        sched_yield();
+    }
+    assert(spersist_close() == 0 && spersist_generation() == 1);
+
+    // the thread exits without giving its list back, the caches start over on sbrk
+    persist_worker_filled = false;
+    pthread_join(thread, nullptr);
+    void* fixed = smalloc_fixed<64>();
+    void* node = pool.allocate(24);
+    assert((char*)fixed < PERSIST_BASE && (char*)node < PERSIST_BASE);
+    sfree_fixed<64>(fixed);
+    pool.deallocate(node, 24);
+}
+
+void test_persistent_caches() {
+    // the caches drop the blocks of a closed heap instead of handing them out
+    bool per_cpu[] = {true, false};
+    for (bool cpu : per_cpu) {
+        char path[] = "/tmp/smalloc_persist_XXXXXX";
+        int fd = mkstemp(path);
+        assert(fd >= 0);
+        close(fd);
+        pid_t pid = fork();
+        if (pid == 0) {
+            persist_caches(path, cpu);
+            exit(0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        assert(status == 0);
+        unlink(path);
+    }
+}
+
+#ifdef SMALLOC_DEBUG
+
+void overflow_by_one() {
+    char* p = (char*)smalloc(13);
+    p[13] = 0;
+    sfree(p);
+}
+
+void free_twice() {
+    void* p = smalloc(100);
+    sfree(p);
+    sfree(p);
+}
+
+void write_after_free() {
+    char* p = (char*)smalloc(100);
+    sfree(p);
+    p[0] = 'x';
+    // push it out of the quarantine
+    for (int i = 0; i < 2 * QUARANTINE_BLOCKS; i++) {
+        sfree(smalloc(100));
+    }
+}
+
+void free_foreign() {
+    static size_t not_ours[4];
+    sfree(&not_ours[2]);
+}
+
+void corrupt_header() {
+    void* p = smalloc(100);
+    ((MetaData*)p - 1)->size = 8;
+    sfree(p);
+}
+
+void test_debug_checks() {
+    expect_signal(overflow_by_one, SIGABRT);
+    expect_signal(free_twice, SIGABRT);
+    expect_signal(write_after_free, SIGABRT);
+    expect_signal(corrupt_header, SIGABRT);
+    expect_signal(free_foreign, SIGABRT);
+
+    // a correct program runs through
+    char* p = (char*)smalloc(13);
+    memset(p, 1, 13);
+    assert(smalloc_usable_size(p) == 13);
+    p = (char*)srealloc(p, 200);
+    assert(p[12] == 1);
+    sfree_sized(p, 200);
+}
+
+void test_debug_quarantine() {
+    // a freed block isn't handed out again right away
+    void* p = smalloc(100);
+    sfree(p);
+    void* q = smalloc(100);
+    assert(q != p);
+    assert(((unsigned char*)p)[0] == FREED_BYTE);
+    sfree(q);
+}
+
+#ifdef SMALLOC_GUARD_PAGES
+void overflow_mmap_block() {
+    char* p = (char*)smalloc(LARGE_ALLOC + 1);
+    // the canary takes the first bytes past the block, then the guard page starts
+    p[LARGE_ALLOC + 1 + CANARY_SIZE + 7] = 0;
+}
+
+void test_debug_guard_pages() {
+    expect_signal(overflow_mmap_block, SIGSEGV);
+}
+#endif
+
+#endif
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+static void callTestFunction(void (*func)()) {
+    if (!fork()) {  // test as son, to get a clear heap
+        func();
+        exit(0);
+    } else {		// father waits for son before continuing to next test
+        int exit_status = 0;
+        wait(&exit_status);
+        if (exit_status)
+            std::cout << "*** FAILED with exit status " << exit_status << std::endl;
+    }
+}
+
+int main()
+{
+    std::cout << "test_batch_functions" << std::endl;
+    callTestFunction(test_batch_functions);
+    std::cout << "test_sized_functions" << std::endl;
+    callTestFunction(test_sized_functions);
+    std::cout << "test_regions" << std::endl;
+    callTestFunction(test_regions);
+    std::cout << "test_expand_inplace" << std::endl;
+    callTestFunction(test_expand_inplace);
+    std::cout << "test_best_fit_tree" << std::endl;
+    callTestFunction(test_best_fit_tree);
+    std::cout << "test_boundary_tags" << std::endl;
+    callTestFunction(test_boundary_tags);
+    std::cout << "test_sbrk_chunks" << std::endl;
+    callTestFunction(test_sbrk_chunks);
+    std::cout << "test_heap_segments" << std::endl;
+    callTestFunction(test_heap_segments);
+    std::cout << "test_mmap_threshold" << std::endl;
+    callTestFunction(test_mmap_threshold);
+    std::cout << "test_threads" << std::endl;
+    callTestFunction(test_threads);
+    std::cout << "test_fork_while_allocating" << std::endl;
+    callTestFunction(test_fork_while_allocating);
+    std::cout << "test_signal_reentry" << std::endl;
+    callTestFunction(test_signal_reentry);
+    std::cout << "test_numa_arenas" << std::endl;
+    callTestFunction(test_numa_arenas);
+    std::cout << "test_numa_node_policy" << std::endl;
+    callTestFunction(test_numa_node_policy);
+    std::cout << "test_stl_allocators" << std::endl;
+    callTestFunction(test_stl_allocators);
+    std::cout << "test_fixed_sizes" << std::endl;
+    callTestFunction(test_fixed_sizes);
+    std::cout << "test_fixed_per_cpu" << std::endl;
+    callTestFunction(test_fixed_per_cpu);
+    std::cout << "test_stream_copy" << std::endl;
+    callTestFunction(test_stream_copy);
+    std::cout << "test_growing_blocks" << std::endl;
+    callTestFunction(test_growing_blocks);
+    std::cout << "test_shrinking_blocks" << std::endl;
+    callTestFunction(test_shrinking_blocks);
+    std::cout << "test_deferred_coalescing" << std::endl;
+    callTestFunction(test_deferred_coalescing);
+    std::cout << "test_page_map" << std::endl;
+    callTestFunction(test_page_map);
+    std::cout << "test_persistent_heap" << std::endl;
+    callTestFunction(test_persistent_heap);
+    std::cout << "test_persistent_caches" << std::endl;
+    callTestFunction(test_persistent_caches);
+    std::cout << "test_maintenance_thread" << std::endl;
+    callTestFunction(test_maintenance_thread);
+    std::cout << "test_overflow_and_move" << std::endl;
+    callTestFunction(test_overflow_and_move);
+    std::cout << "test_memory_pressure" << std::endl;
+    callTestFunction(test_memory_pressure);
+#ifdef SMALLOC_DEBUG
+    std::cout << "test_debug_checks" << std::endl;
+    callTestFunction(test_debug_checks);
+    std::cout << "test_debug_quarantine" << std::endl;
+    callTestFunction(test_debug_quarantine);
+#endif
+#ifdef SMALLOC_GUARD_PAGES
+    std::cout << "test_debug_guard_pages" << std::endl;
+    callTestFunction(test_debug_guard_pages);
+#endif
+    return 0;
+}
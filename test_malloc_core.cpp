@@ -0,0 +1,153 @@
+/*
+HOW TO RUN?
+	g++ -std=c++17 -pthread test_malloc_core.cpp -o test_malloc_core
+	./test_malloc_core
+
+NOTE: like the tamuz tests, every test runs in a child process. Several heaps of different
+      policies live in the same process and share the break.
+ */
+
+#include "malloc_core.h"
+#include <unistd.h>
+#include <assert.h>
+#include <sys/wait.h>
+#include <iostream>
+
+#define KB 1024
+
+typedef SmallocCore<BestFit, SplitAbove<128>, MergeNeighbours, Align<8>, NoLarge, NoLock> BestFitHeap;
+
+/*******************************************************************************
+ *  TESTS
+ ******************************************************************************/
+
+void test_variant_layouts() {
+    // the aliases keep the headers of the files they replaced
+    assert(Malloc2::_size_meta_data() == 32);
+    assert(Malloc3::_size_meta_data() == 48);
+    assert(BestFitHeap::_size_meta_data() == 32);
+
+    Malloc2 heap;
+    char* base = (char*)sbrk(0);
+    char* a = (char*)heap.smalloc(10);
+    char* b = (char*)heap.smalloc(10);
+    assert(a == base + 32 && b == a + 10 + 32);
+    assert(heap.smalloc(0) == nullptr && heap.smalloc(100000001) == nullptr);
+    assert(heap.scalloc(1 << 20, 1 << 20) == nullptr);
+
+    // no split: the freed block is reused whole
+    heap.sfree(a);
+    assert(heap.smalloc(1) == a);
+    assert(heap._num_allocated_bytes() == 20 && heap._num_free_blocks() == 0);
+}
+
+void test_split_merge_wilderness() {
+    Malloc3 heap;
+    char* a = (char*)heap.smalloc(4 * KB);
+    char* b = (char*)heap.smalloc(4 * KB);
+    char* c = (char*)heap.smalloc(4 * KB);
+    assert(a && b && c);
+
+    // a freed block merges with its free neighbours
+    heap.sfree(a);
+    heap.sfree(c);
+    assert(heap._num_free_blocks() == 2);
+    heap.sfree(b);
+    assert(heap._num_free_blocks() == 1 && heap._num_allocated_blocks() == 1);
+    assert(heap._num_free_bytes() == 12 * KB + 2 * 48);
+
+    // and is split when a smaller block is taken from it
+    assert(heap.smalloc(1 * KB) == a);
+    assert(heap._num_free_blocks() == 1 && heap._num_allocated_blocks() == 2);
+
+    // the free wilderness grows instead of a new block
+    char* big = (char*)heap.smalloc(20 * KB);
+    assert(big == a + 1 * KB + 48 && (char*)sbrk(0) == big + 20 * KB);
+
+    // srealloc grows into the free block before it, and the wilderness in place
+    heap.sfree(a);
+    char* moved = (char*)heap.srealloc(big, 21 * KB);
+    assert(moved == a);
+    assert(heap.srealloc(moved, 40 * KB) == moved && (char*)sbrk(0) == moved + 40 * KB);
+
+    // large blocks are mapped, and go back to the heap when they shrink
+    char* mapped = (char*)heap.smalloc(128 * KB);
+    assert(mapped != nullptr && (mapped > (char*)sbrk(0) || mapped < a));
+    memset(mapped, 'x', 128 * KB);
+    char* back = (char*)heap.srealloc(mapped, 100);
+    assert(back != nullptr && back >= a && back < (char*)sbrk(0) && back[99] == 'x');
+    assert(heap._num_allocated_blocks() == 2);
+}
+
+void test_heaps_side_by_side() {
+    Malloc3 first;
+    SegregatedLocked second;
+
+    // the blocks of both heaps take turns at the break, neither merges the other's
+    char* a = (char*)first.smalloc(1000);
+    char* b = (char*)second.smalloc(1001);
+    char* c = (char*)first.smalloc(1000);
+    char* e = (char*)second.smalloc(8);
+    assert(b == a + 1000 + 48 && c == b + 1008 + 48 && e == c + 1000 + 48);
+    first.sfree(a);
+    first.sfree(c);
+    second.sfree(b);
+    assert(first._num_free_blocks() == 2 && second._num_free_blocks() == 1);
+
+    // nor grows its last block when the other's blocks follow it
+    char* d = (char*)first.smalloc(2000);
+    assert(d > e);
+    assert(first._num_free_blocks() == 2 && first._num_allocated_blocks() == 3);
+}
+
+void test_fit_strategies() {
+    Malloc2 first;
+    BestFitHeap best;
+    void* first_blocks[3];
+    void* best_blocks[3];
+    size_t sizes[3] = {3000, 1000, 2000};
+    for (int i = 0; i < 3; i++) {
+        first_blocks[i] = first.smalloc(sizes[i]);
+        first.smalloc(8);  // keeps the free blocks apart
+        best_blocks[i] = best.smalloc(sizes[i]);
+        best.smalloc(8);
+    }
+    for (int i = 0; i < 3; i++) {
+        first.sfree(first_blocks[i]);
+        best.sfree(best_blocks[i]);
+    }
+
+    // first fit takes the first block that fits, best fit the smallest
+    assert(first.smalloc(900) == first_blocks[0]);
+    assert(best.smalloc(900) == best_blocks[1]);
+    assert(best.smalloc(1500) == best_blocks[2]);
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+static void callTestFunction(void (*func)()) {
+    if (!fork()) {  // test as son, to get a clear heap
+        func();
+        exit(0);
+    } else {		// father waits for son before continuing to next test
+        int exit_status = 0;
+        wait(&exit_status);
+        if (exit_status)
+            std::cout << "*** FAILED with exit status " << exit_status << std::endl;
+    }
+}
+
+int main()
+{
+    std::cout << "test_variant_layouts" << std::endl;
+    callTestFunction(test_variant_layouts);
+    std::cout << "test_split_merge_wilderness" << std::endl;
+    callTestFunction(test_split_merge_wilderness);
+    std::cout << "test_heaps_side_by_side" << std::endl;
+    callTestFunction(test_heaps_side_by_side);
+    std::cout << "test_fit_strategies" << std::endl;
+    callTestFunction(test_fit_strategies);
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*
+HOW TO RUN?
+	g++ -std=c++17 -pthread test_malloc_shm.cpp -o test_malloc_shm
+	./test_malloc_shm
+
+NOTE: like the tamuz tests, every test runs in a child process. The heaps are shared with
+      further children (fork) or other processes (shm_heap_open), to check what they see.
+ */
+
+#include "malloc_shm.cpp"
+#include <unistd.h>
+#include <assert.h>
+#include <cstdio>
+#include <sys/wait.h>
+#include <iostream>
+
+/*******************************************************************************
+ *  AUXILIARY FUNCTIONS
+ ******************************************************************************/
+
+/* Runs func in a child process and returns its exit status. */
+int in_child(void (*func)(ShmHeap*), ShmHeap* heap) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        func(heap);
+        exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return status;
+}
+
+void die_holding_lock(ShmHeap* heap) {
+    pthread_mutex_lock(&heap->mutex);
+    exit(0);
+}
+
+void die_while_updating(ShmHeap* heap) {
+    pthread_mutex_lock(&heap->mutex);
+    heap->updating = true;
+    exit(0);
+}
+
+/*******************************************************************************
+ *  TESTS
+ ******************************************************************************/
+
+void test_shm_blocks() {
+    ShmHeap* heap = shm_heap_create(nullptr, 64 * KB);
+    assert(heap != nullptr);
+    assert(shm_smalloc(heap, 0) == nullptr);
+
+    // blocks are carved from the break, freed ones merge with their free neighbours
+    void* a = shm_smalloc(heap, 100);
+    void* b = shm_smalloc(heap, 200);
+    void* c = shm_smalloc(heap, 300);
+    assert(a && b && c && _shm_num_allocated_blocks(heap) == 3);
+    assert(_shm_num_allocated_bytes(heap) == 104 + 200 + 304);
+    shm_sfree(heap, a);
+    shm_sfree(heap, c);
+    assert(_shm_num_free_blocks(heap) == 2);
+    shm_sfree(heap, b);
+    shm_sfree(heap, b);
+    assert(_shm_num_free_blocks(heap) == 1 && _shm_num_allocated_blocks(heap) == 1);
+    assert(_shm_num_free_bytes(heap) == 104 + 200 + 304 + 2 * MD_SIZE);
+
+    // the merged block is reused, and split when it is big enough
+    assert(shm_smalloc(heap, 50) == a);
+    assert(_shm_num_free_blocks(heap) == 1 && _shm_num_allocated_blocks(heap) == 2);
+
+    // the heap can't grow past its capacity
+    assert(shm_smalloc(heap, 64 * KB) == nullptr);
+    void* rest = shm_smalloc(heap, 60 * KB);
+    assert(rest != nullptr && shm_smalloc(heap, 4 * KB) == nullptr);
+
+    // offsets round trip
+    assert(shm_pointer(heap, shm_offset(heap, rest)) == rest);
+    assert(shm_offset(heap, nullptr) == 0 && shm_pointer(heap, 0) == nullptr);
+    shm_heap_close(heap);
+}
+
+void test_shm_two_processes() {
+    char name[64];
+    snprintf(name, sizeof(name), "/smalloc_test_%d", getpid());
+    ShmHeap* heap = shm_heap_create(name, 1024 * KB);
+    assert(heap != nullptr);
+    assert(shm_heap_create(name, 1024 * KB) == nullptr);
+
+    // the other process maps the heap on its own and sends back an offset
+    int pipe_fds[2];
+    assert(pipe(pipe_fds) == 0);
+    if (fork() == 0) {
+        ShmHeap* other = shm_heap_open(name);
+        assert(other != nullptr);
+        char* message = (char*)shm_smalloc(other, 500 * KB);
+        assert(message != nullptr);
+        memset(message, 'x', 500 * KB);
+        strcpy(message, "hello");
+        size_t offset = shm_offset(other, message);
+        assert(write(pipe_fds[1], &offset, sizeof(offset)) == sizeof(offset));
+        exit(0);
+    }
+    size_t offset = 0;
+    assert(read(pipe_fds[0], &offset, sizeof(offset)) == sizeof(offset));
+    wait(nullptr);
+
+    // this one reads it in place and frees it
+    char* message = (char*)shm_pointer(heap, offset);
+    assert(strcmp(message, "hello") == 0 && message[500 * KB - 1] == 'x');
+    assert(_shm_num_allocated_blocks(heap) == 1 && _shm_num_free_blocks(heap) == 0);
+    shm_sfree(heap, message);
+    assert(_shm_num_free_blocks(heap) == 1);
+
+    shm_heap_close(heap);
+    assert(shm_heap_unlink(name) == 0);
+    assert(shm_heap_open(name) == nullptr);
+}
+
+void test_shm_dead_owner() {
+    ShmHeap* heap = shm_heap_create(nullptr, 64 * KB);
+    assert(heap != nullptr);
+
+    // a process that dies holding the lock doesn't block the heap
+    assert(in_child(die_holding_lock, heap) == 0);
+    void* p = shm_smalloc(heap, 100);
+    assert(p != nullptr);
+
+    // unless it died in the middle of an update, then the heap is refused
+    assert(in_child(die_while_updating, heap) == 0);
+    assert(shm_smalloc(heap, 100) == nullptr);
+    shm_heap_close(heap);
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+static void callTestFunction(void (*func)()) {
+    if (!fork()) {  // test as son, to get a clear heap
+        func();
+        exit(0);
+    } else {		// father waits for son before continuing to next test
+        int exit_status = 0;
+        wait(&exit_status);
+        if (exit_status)
+            std::cout << "*** FAILED with exit status " << exit_status << std::endl;
+    }
+}
+
+int main()
+{
+    std::cout << "test_shm_blocks" << std::endl;
+    callTestFunction(test_shm_blocks);
+    std::cout << "test_shm_two_processes" << std::endl;
+    callTestFunction(test_shm_two_processes);
+    std::cout << "test_shm_dead_owner" << std::endl;
+    callTestFunction(test_shm_dead_owner);
+    return 0;
+}